@@ -0,0 +1,522 @@
+#include "C2P.h"
+#include "Debug.h"
+#include <cassert>
+#include <cstring>
+#include <atomic>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define QILBM_C2P_X86
+    #include <immintrin.h>
+#endif
+
+using namespace qilbm;
+
+// 8x8 bit matrix transpose (Hacker's Delight): bit (8 * a + b) ends up at
+// bit (8 * b + a). Fed with one byte per plane this yields one byte per pixel,
+// where the most significant byte holds the leftmost pixel.
+static inline uint64_t transpose8x8(uint64_t x) {
+    uint64_t t;
+    t = (x ^ (x >>  7)) & 0x00AA00AA00AA00AAULL; x = x ^ t ^ (t <<  7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL; x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL; x = x ^ t ^ (t << 28);
+    return x;
+}
+
+template<size_t NumPlanes>
+static inline uint64_t load_planes(const uint8_t* planes, size_t plane_len) {
+    uint64_t x = 0;
+    for (size_t plane_index = 0; plane_index < NumPlanes; ++ plane_index) {
+        x |= (uint64_t)planes[plane_index * plane_len] << (plane_index * 8);
+    }
+    return x;
+}
+
+static inline void store_pixels(uint8_t* pixels, uint64_t value) {
+    pixels[0] = (uint8_t)(value >> 56);
+    pixels[1] = (uint8_t)(value >> 48);
+    pixels[2] = (uint8_t)(value >> 40);
+    pixels[3] = (uint8_t)(value >> 32);
+    pixels[4] = (uint8_t)(value >> 24);
+    pixels[5] = (uint8_t)(value >> 16);
+    pixels[6] = (uint8_t)(value >>  8);
+    pixels[7] = (uint8_t)value;
+}
+
+template<size_t NumPlanes>
+static void c2p_indexed(const uint8_t* planes, size_t plane_len, size_t width, uint8_t* pixels) {
+    const size_t full_bytes = width / 8;
+    size_t byte_index = 0;
+
+    // plane rows are padded to 16 bits, so do a full plane word per iteration
+    for (; byte_index + 1 < full_bytes; byte_index += 2) {
+        const uint64_t value1 = transpose8x8(load_planes<NumPlanes>(planes + byte_index, plane_len));
+        const uint64_t value2 = transpose8x8(load_planes<NumPlanes>(planes + byte_index + 1, plane_len));
+        store_pixels(pixels + byte_index * 8, value1);
+        store_pixels(pixels + byte_index * 8 + 8, value2);
+    }
+
+    for (; byte_index < full_bytes; ++ byte_index) {
+        store_pixels(pixels + byte_index * 8, transpose8x8(load_planes<NumPlanes>(planes + byte_index, plane_len)));
+    }
+
+    const size_t rem = width % 8;
+    if (rem > 0) {
+        const uint64_t value = transpose8x8(load_planes<NumPlanes>(planes + byte_index, plane_len));
+        uint8_t* out = pixels + byte_index * 8;
+        for (size_t index = 0; index < rem; ++ index) {
+            out[index] = (uint8_t)(value >> (56 - index * 8));
+        }
+    }
+}
+
+// Deep images store each channel as 8 consecutive planes, so each channel is
+// one 8 plane transpose. The results are then interleaved into RGB(A) pixels.
+template<size_t Channels>
+static void c2p_deep(const uint8_t* planes, size_t plane_len, size_t width, uint8_t* pixels) {
+    const size_t channel_len = plane_len * 8;
+    const size_t byte_count = (width + 7) / 8;
+
+    for (size_t byte_index = 0; byte_index < byte_count; ++ byte_index) {
+        uint64_t values[Channels];
+        for (size_t channel = 0; channel < Channels; ++ channel) {
+            values[channel] = transpose8x8(load_planes<8>(planes + channel * channel_len + byte_index, plane_len));
+        }
+
+        const size_t x = byte_index * 8;
+        const size_t count = width - x < 8 ? width - x : 8;
+        uint8_t* out = pixels + x * Channels;
+        for (size_t index = 0; index < count; ++ index) {
+            const unsigned int shift = 56 - index * 8;
+            for (size_t channel = 0; channel < Channels; ++ channel) {
+                out[channel] = (uint8_t)(values[channel] >> shift);
+            }
+            out += Channels;
+        }
+    }
+}
+
+static void scalar_planar_to_chunky(const uint8_t* planes, size_t plane_len, size_t num_planes, size_t width, uint8_t* pixels) {
+    switch (num_planes) {
+        case  1: c2p_indexed<1>(planes, plane_len, width, pixels); break;
+        case  2: c2p_indexed<2>(planes, plane_len, width, pixels); break;
+        case  3: c2p_indexed<3>(planes, plane_len, width, pixels); break;
+        case  4: c2p_indexed<4>(planes, plane_len, width, pixels); break;
+        case  5: c2p_indexed<5>(planes, plane_len, width, pixels); break;
+        case  6: c2p_indexed<6>(planes, plane_len, width, pixels); break;
+        case  7: c2p_indexed<7>(planes, plane_len, width, pixels); break;
+        case  8: c2p_indexed<8>(planes, plane_len, width, pixels); break;
+        case 24: c2p_deep<3>(planes, plane_len, width, pixels); break;
+        case 32: c2p_deep<4>(planes, plane_len, width, pixels); break;
+
+        default:
+            LOG_DEBUG("unsupported number of bit planes: %zu", num_planes);
+            assert(false);
+            break;
+    }
+}
+
+#ifdef QILBM_C2P_X86
+// ---- SSE2 -------------------------------------------------------------------
+//
+// pmovmskb collects the most significant bit of every byte, which is the
+// leftmost pixel of each plane byte. With one plane per byte that is exactly
+// one chunky pixel. Adding the vector to itself moves the next pixel up.
+
+// Reorders 8 little endian 16 bit lanes into [low bytes..., high bytes...].
+__attribute__((target("sse2")))
+static inline __m128i sse2_deinterleave(__m128i v) {
+    const __m128i low_mask = _mm_set1_epi16(0x00FF);
+    return _mm_packus_epi16(_mm_and_si128(v, low_mask), _mm_srli_epi16(v, 8));
+}
+
+// Returns byte N: plane N for pixels 0-7, byte 8 + N: plane N for pixels 8-15.
+template<size_t NumPlanes>
+__attribute__((target("sse2")))
+static inline __m128i sse2_load_planes(const uint8_t* planes, size_t plane_len) {
+    auto word = [planes, plane_len](size_t plane_index) -> short {
+        if (plane_index >= NumPlanes) {
+            return 0;
+        }
+        uint16_t value;
+        std::memcpy(&value, planes + plane_index * plane_len, 2);
+        return (short)value;
+    };
+
+    return sse2_deinterleave(_mm_setr_epi16(
+        word(0), word(1), word(2), word(3), word(4), word(5), word(6), word(7)));
+}
+
+// 8 planes x 16 pixels to 16 chunky pixels.
+__attribute__((target("sse2")))
+static inline __m128i sse2_transpose(__m128i v) {
+    short rows[8];
+    for (size_t bit = 0; bit < 8; ++ bit) {
+        rows[bit] = (short)_mm_movemask_epi8(v);
+        v = _mm_add_epi8(v, v);
+    }
+
+    // rows[N]: low byte is pixel N, high byte is pixel 8 + N
+    return sse2_deinterleave(_mm_setr_epi16(
+        rows[0], rows[1], rows[2], rows[3], rows[4], rows[5], rows[6], rows[7]));
+}
+
+__attribute__((target("sse2")))
+static inline void sse2_store_rgba(uint8_t* pixels, __m128i r, __m128i g, __m128i b, __m128i a) {
+    const __m128i rg_lo = _mm_unpacklo_epi8(r, g);
+    const __m128i rg_hi = _mm_unpackhi_epi8(r, g);
+    const __m128i ba_lo = _mm_unpacklo_epi8(b, a);
+    const __m128i ba_hi = _mm_unpackhi_epi8(b, a);
+
+    _mm_storeu_si128((__m128i*)(pixels +  0), _mm_unpacklo_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128((__m128i*)(pixels + 16), _mm_unpackhi_epi16(rg_lo, ba_lo));
+    _mm_storeu_si128((__m128i*)(pixels + 32), _mm_unpacklo_epi16(rg_hi, ba_hi));
+    _mm_storeu_si128((__m128i*)(pixels + 48), _mm_unpackhi_epi16(rg_hi, ba_hi));
+}
+
+template<size_t NumPlanes>
+__attribute__((target("sse2")))
+static void sse2_c2p_indexed(const uint8_t* planes, size_t plane_len, size_t width, uint8_t* pixels) {
+    const size_t word_count = width / 16;
+
+    for (size_t word_index = 0; word_index < word_count; ++ word_index) {
+        const __m128i value = sse2_transpose(sse2_load_planes<NumPlanes>(planes + word_index * 2, plane_len));
+        _mm_storeu_si128((__m128i*)(pixels + word_index * 16), value);
+    }
+
+    const size_t done = word_count * 16;
+    if (done < width) {
+        c2p_indexed<NumPlanes>(planes + word_count * 2, plane_len, width - done, pixels + done);
+    }
+}
+
+template<size_t Channels>
+__attribute__((target("sse2")))
+static void sse2_c2p_deep(const uint8_t* planes, size_t plane_len, size_t width, uint8_t* pixels) {
+    const size_t channel_len = plane_len * 8;
+    const size_t word_count = width / 16;
+
+    for (size_t word_index = 0; word_index < word_count; ++ word_index) {
+        __m128i values[Channels];
+        for (size_t channel = 0; channel < Channels; ++ channel) {
+            values[channel] = sse2_transpose(sse2_load_planes<8>(planes + channel * channel_len + word_index * 2, plane_len));
+        }
+
+        uint8_t* out = pixels + word_index * 16 * Channels;
+        if constexpr (Channels == 4) {
+            sse2_store_rgba(out, values[0], values[1], values[2], values[3]);
+        } else {
+            alignas(16) uint8_t channels[Channels][16];
+            for (size_t channel = 0; channel < Channels; ++ channel) {
+                _mm_store_si128((__m128i*)channels[channel], values[channel]);
+            }
+            for (size_t index = 0; index < 16; ++ index) {
+                for (size_t channel = 0; channel < Channels; ++ channel) {
+                    *out ++ = channels[channel][index];
+                }
+            }
+        }
+    }
+
+    const size_t done = word_count * 16;
+    if (done < width) {
+        c2p_deep<Channels>(planes + word_count * 2, plane_len, width - done, pixels + done * Channels);
+    }
+}
+
+__attribute__((target("sse2")))
+static void sse2_planar_to_chunky(const uint8_t* planes, size_t plane_len, size_t num_planes, size_t width, uint8_t* pixels) {
+    switch (num_planes) {
+        case  1: sse2_c2p_indexed<1>(planes, plane_len, width, pixels); break;
+        case  2: sse2_c2p_indexed<2>(planes, plane_len, width, pixels); break;
+        case  3: sse2_c2p_indexed<3>(planes, plane_len, width, pixels); break;
+        case  4: sse2_c2p_indexed<4>(planes, plane_len, width, pixels); break;
+        case  5: sse2_c2p_indexed<5>(planes, plane_len, width, pixels); break;
+        case  6: sse2_c2p_indexed<6>(planes, plane_len, width, pixels); break;
+        case  7: sse2_c2p_indexed<7>(planes, plane_len, width, pixels); break;
+        case  8: sse2_c2p_indexed<8>(planes, plane_len, width, pixels); break;
+        case 24: sse2_c2p_deep<3>(planes, plane_len, width, pixels); break;
+        case 32: sse2_c2p_deep<4>(planes, plane_len, width, pixels); break;
+
+        default:
+            scalar_planar_to_chunky(planes, plane_len, num_planes, width, pixels);
+            break;
+    }
+}
+
+// ---- AVX2 -------------------------------------------------------------------
+//
+// Same idea with 32 pixels per step. The 4 bytes loaded from each plane are
+// regrouped with a byte shuffle and a dword permute instead of a gather.
+
+// Regroups 8 dwords of 4 bytes each so that byte 8 * N + M is byte N of dword M.
+__attribute__((target("avx2")))
+static inline __m256i avx2_regroup(__m256i v) {
+    const __m256i shuffle = _mm256_setr_epi8(
+        0, 4,  8, 12, 1, 5,  9, 13, 2, 6, 10, 14, 3, 7, 11, 15,
+        0, 4,  8, 12, 1, 5,  9, 13, 2, 6, 10, 14, 3, 7, 11, 15);
+    const __m256i permute = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    return _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(v, shuffle), permute);
+}
+
+// Returns byte 8 * N + M: plane M for pixels 8 * N to 8 * N + 7.
+template<size_t NumPlanes>
+__attribute__((target("avx2")))
+static inline __m256i avx2_load_planes(const uint8_t* planes, size_t plane_len) {
+    auto dword = [planes, plane_len](size_t plane_index) -> int {
+        if (plane_index >= NumPlanes) {
+            return 0;
+        }
+        uint32_t value;
+        std::memcpy(&value, planes + plane_index * plane_len, 4);
+        return (int)value;
+    };
+
+    return avx2_regroup(_mm256_setr_epi32(
+        dword(0), dword(1), dword(2), dword(3), dword(4), dword(5), dword(6), dword(7)));
+}
+
+// 8 planes x 32 pixels to 32 chunky pixels.
+__attribute__((target("avx2")))
+static inline __m256i avx2_transpose(__m256i v) {
+    int rows[8];
+    for (size_t bit = 0; bit < 8; ++ bit) {
+        rows[bit] = _mm256_movemask_epi8(v);
+        v = _mm256_add_epi8(v, v);
+    }
+
+    // byte N of rows[M] is pixel 8 * N + M
+    return avx2_regroup(_mm256_setr_epi32(
+        rows[0], rows[1], rows[2], rows[3], rows[4], rows[5], rows[6], rows[7]));
+}
+
+template<size_t NumPlanes>
+__attribute__((target("avx2")))
+static void avx2_c2p_indexed(const uint8_t* planes, size_t plane_len, size_t width, uint8_t* pixels) {
+    const size_t block_count = width / 32;
+
+    for (size_t block_index = 0; block_index < block_count; ++ block_index) {
+        const __m256i value = avx2_transpose(avx2_load_planes<NumPlanes>(planes + block_index * 4, plane_len));
+        _mm256_storeu_si256((__m256i*)(pixels + block_index * 32), value);
+    }
+
+    const size_t done = block_count * 32;
+    if (done < width) {
+        sse2_c2p_indexed<NumPlanes>(planes + block_count * 4, plane_len, width - done, pixels + done);
+    }
+}
+
+template<size_t Channels>
+__attribute__((target("avx2")))
+static void avx2_c2p_deep(const uint8_t* planes, size_t plane_len, size_t width, uint8_t* pixels) {
+    const size_t channel_len = plane_len * 8;
+    const size_t block_count = width / 32;
+
+    for (size_t block_index = 0; block_index < block_count; ++ block_index) {
+        __m256i values[Channels];
+        for (size_t channel = 0; channel < Channels; ++ channel) {
+            values[channel] = avx2_transpose(avx2_load_planes<8>(planes + channel * channel_len + block_index * 4, plane_len));
+        }
+
+        uint8_t* out = pixels + block_index * 32 * Channels;
+        if constexpr (Channels == 4) {
+            sse2_store_rgba(out,
+                _mm256_castsi256_si128(values[0]), _mm256_castsi256_si128(values[1]),
+                _mm256_castsi256_si128(values[2]), _mm256_castsi256_si128(values[3]));
+            sse2_store_rgba(out + 64,
+                _mm256_extracti128_si256(values[0], 1), _mm256_extracti128_si256(values[1], 1),
+                _mm256_extracti128_si256(values[2], 1), _mm256_extracti128_si256(values[3], 1));
+        } else {
+            alignas(32) uint8_t channels[Channels][32];
+            for (size_t channel = 0; channel < Channels; ++ channel) {
+                _mm256_store_si256((__m256i*)channels[channel], values[channel]);
+            }
+            for (size_t index = 0; index < 32; ++ index) {
+                for (size_t channel = 0; channel < Channels; ++ channel) {
+                    *out ++ = channels[channel][index];
+                }
+            }
+        }
+    }
+
+    const size_t done = block_count * 32;
+    if (done < width) {
+        sse2_c2p_deep<Channels>(planes + block_count * 4, plane_len, width - done, pixels + done * Channels);
+    }
+}
+
+__attribute__((target("avx2")))
+static void avx2_planar_to_chunky(const uint8_t* planes, size_t plane_len, size_t num_planes, size_t width, uint8_t* pixels) {
+    switch (num_planes) {
+        case  1: avx2_c2p_indexed<1>(planes, plane_len, width, pixels); break;
+        case  2: avx2_c2p_indexed<2>(planes, plane_len, width, pixels); break;
+        case  3: avx2_c2p_indexed<3>(planes, plane_len, width, pixels); break;
+        case  4: avx2_c2p_indexed<4>(planes, plane_len, width, pixels); break;
+        case  5: avx2_c2p_indexed<5>(planes, plane_len, width, pixels); break;
+        case  6: avx2_c2p_indexed<6>(planes, plane_len, width, pixels); break;
+        case  7: avx2_c2p_indexed<7>(planes, plane_len, width, pixels); break;
+        case  8: avx2_c2p_indexed<8>(planes, plane_len, width, pixels); break;
+        case 24: avx2_c2p_deep<3>(planes, plane_len, width, pixels); break;
+        case 32: avx2_c2p_deep<4>(planes, plane_len, width, pixels); break;
+
+        default:
+            scalar_planar_to_chunky(planes, plane_len, num_planes, width, pixels);
+            break;
+    }
+}
+#endif
+
+// ---- palette expansion ------------------------------------------------------
+
+static void scalar_expand_indexed(const uint8_t* indices, const uint32_t* lut, size_t width, size_t pixel_len, uint8_t* pixels) {
+    if (pixel_len == 4) {
+        for (size_t x = 0; x < width; ++ x) {
+            std::memcpy(pixels + x * 4, &lut[indices[x]], 4);
+        }
+    } else if (width > 0) {
+        // whole words, the 4th byte is overwritten by the next pixel
+        size_t x = 0;
+        for (; x + 1 < width; ++ x) {
+            std::memcpy(pixels + x * 3, &lut[indices[x]], 4);
+        }
+        std::memcpy(pixels + x * 3, &lut[indices[x]], 3);
+    }
+}
+
+#ifdef QILBM_C2P_X86
+__attribute__((target("avx2")))
+static void avx2_expand_indexed(const uint8_t* indices, const uint32_t* lut, size_t width, size_t pixel_len, uint8_t* pixels) {
+    size_t x = 0;
+
+    if (pixel_len == 4) {
+        for (; x + 8 <= width; x += 8) {
+            const __m256i offsets = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + x)));
+            const __m256i values = _mm256_i32gather_epi32((const int*)lut, offsets, 4);
+            _mm256_storeu_si256((__m256i*)(pixels + x * 4), values);
+        }
+    } else {
+        // drops the 4th byte of each pixel, leaving 12 bytes per 128 bit lane
+        const __m256i pack_rgb = _mm256_setr_epi8(
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+
+        // each store writes 4 bytes too many, which have to be within the row
+        for (; x + 10 <= width; x += 8) {
+            const __m256i offsets = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(indices + x)));
+            const __m256i values = _mm256_shuffle_epi8(_mm256_i32gather_epi32((const int*)lut, offsets, 4), pack_rgb);
+            _mm_storeu_si128((__m128i*)(pixels + x * 3), _mm256_castsi256_si128(values));
+            _mm_storeu_si128((__m128i*)(pixels + x * 3 + 12), _mm256_extracti128_si256(values, 1));
+        }
+    }
+
+    scalar_expand_indexed(indices + x, lut, width - x, pixel_len, pixels + x * pixel_len);
+}
+#endif
+
+// ---- kernel selection -------------------------------------------------------
+
+static std::atomic<C2PKernel> c2p_selected_kernel { C2PKernel_Auto };
+
+static C2PKernel c2p_best_kernel() {
+#ifdef QILBM_C2P_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return C2PKernel_AVX2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return C2PKernel_SSE2;
+    }
+#endif
+    return C2PKernel_Scalar;
+}
+
+const char *qilbm::c2p_kernel_name(C2PKernel kernel) {
+    switch (kernel) {
+        case C2PKernel_Auto:   return "auto";
+        case C2PKernel_Scalar: return "scalar";
+        case C2PKernel_SSE2:   return "sse2";
+        case C2PKernel_AVX2:   return "avx2";
+        default: return "invalid";
+    }
+}
+
+bool qilbm::c2p_kernel_from_name(const char *name, C2PKernel& kernel) {
+    for (C2PKernel value : { C2PKernel_Auto, C2PKernel_Scalar, C2PKernel_SSE2, C2PKernel_AVX2 }) {
+        if (std::strcmp(name, c2p_kernel_name(value)) == 0) {
+            kernel = value;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool qilbm::c2p_kernel_supported(C2PKernel kernel) {
+    switch (kernel) {
+        case C2PKernel_Auto:
+        case C2PKernel_Scalar:
+            return true;
+
+#ifdef QILBM_C2P_X86
+        case C2PKernel_SSE2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("sse2");
+
+        case C2PKernel_AVX2:
+            __builtin_cpu_init();
+            return __builtin_cpu_supports("avx2");
+#endif
+
+        default:
+            return false;
+    }
+}
+
+bool qilbm::set_c2p_kernel(C2PKernel kernel) {
+    if (!c2p_kernel_supported(kernel)) {
+        LOG_DEBUG("unsupported planar to chunky kernel: %s", c2p_kernel_name(kernel));
+        return false;
+    }
+
+    c2p_selected_kernel.store(kernel, std::memory_order_relaxed);
+    return true;
+}
+
+C2PKernel qilbm::c2p_kernel() {
+    C2PKernel kernel = c2p_selected_kernel.load(std::memory_order_relaxed);
+    if (kernel == C2PKernel_Auto) {
+        kernel = c2p_best_kernel();
+        c2p_selected_kernel.store(kernel, std::memory_order_relaxed);
+    }
+    return kernel;
+}
+
+void qilbm::planar_to_chunky(const uint8_t* planes, size_t plane_len, size_t num_planes, size_t width, uint8_t* pixels) {
+    switch (c2p_kernel()) {
+#ifdef QILBM_C2P_X86
+        case C2PKernel_AVX2:
+            avx2_planar_to_chunky(planes, plane_len, num_planes, width, pixels);
+            break;
+
+        case C2PKernel_SSE2:
+            sse2_planar_to_chunky(planes, plane_len, num_planes, width, pixels);
+            break;
+#endif
+
+        default:
+            scalar_planar_to_chunky(planes, plane_len, num_planes, width, pixels);
+            break;
+    }
+}
+
+void qilbm::expand_indexed(const uint8_t* indices, const uint32_t* lut, size_t width, size_t pixel_len, uint8_t* pixels) {
+    assert(pixel_len == 3 || pixel_len == 4);
+
+#ifdef QILBM_C2P_X86
+    // without a gather instruction the scalar version is just as fast
+    if (c2p_kernel() == C2PKernel_AVX2) {
+        avx2_expand_indexed(indices, lut, width, pixel_len, pixels);
+        return;
+    }
+#endif
+
+    scalar_expand_indexed(indices, lut, width, pixel_len, pixels);
+}
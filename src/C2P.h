@@ -0,0 +1,47 @@
+#ifndef QILBM_C2P_H
+#define QILBM_C2P_H
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+namespace qilbm {
+
+// Implementations of the planar to chunky conversion. By default the fastest
+// one the CPU supports is picked at runtime, but each can be forced (e.g. with
+// the QILBM_C2P environment variable of the Qt plugin) to test it against the
+// scalar reference.
+enum C2PKernel {
+    C2PKernel_Auto   = 0,
+    C2PKernel_Scalar = 1,
+    C2PKernel_SSE2   = 2,
+    C2PKernel_AVX2   = 3,
+};
+
+const char *c2p_kernel_name(C2PKernel kernel);
+bool c2p_kernel_from_name(const char *name, C2PKernel& kernel);
+bool c2p_kernel_supported(C2PKernel kernel);
+
+// Returns false and keeps the current kernel if the CPU doesn't support it.
+bool set_c2p_kernel(C2PKernel kernel);
+
+// The kernel that is used, never C2PKernel_Auto.
+C2PKernel c2p_kernel();
+
+// Converts one row of planar ILBM data into chunky pixels.
+//
+// `planes` points to `num_planes` consecutive plane rows of `plane_len` bytes
+// each (the layout of a BODY row). For 1 to 8 planes one byte is written per
+// pixel, for 24 and 32 planes one byte per channel (RGB888 or RGBA8888).
+// `pixels` must have room for a full row, no bytes past it are written.
+void planar_to_chunky(const uint8_t* planes, size_t plane_len, size_t num_planes, size_t width, uint8_t* pixels);
+
+// Expands one row of palette indices into RGB888 (`pixel_len` 3) or RGBA8888
+// (`pixel_len` 4) pixels. `lut` holds 256 pixels in the byte order of the
+// output image (see PackedPalette). Uses the same kernel as planar_to_chunky()
+// and writes no bytes past the row either.
+void expand_indexed(const uint8_t* indices, const uint32_t* lut, size_t width, size_t pixel_len, uint8_t* pixels);
+
+}
+
+#endif
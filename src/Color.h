@@ -42,6 +42,15 @@ public:
         uint8_t b = (uint8_t)std::round((double)m_b * inv + (double)other.m_b * value);
         return Color(r, g, b);
     }
+
+    // blend() in 16.16 fixed point, `weight` is value * 65536 (0 to 65536).
+    inline Color blend_fixed(const Color& other, uint32_t weight) const {
+        const uint32_t inv = 65536 - weight;
+        uint8_t r = (uint8_t)(((uint32_t)m_r * inv + (uint32_t)other.m_r * weight + 32768) >> 16);
+        uint8_t g = (uint8_t)(((uint32_t)m_g * inv + (uint32_t)other.m_g * weight + 32768) >> 16);
+        uint8_t b = (uint8_t)(((uint32_t)m_b * inv + (uint32_t)other.m_b * weight + 32768) >> 16);
+        return Color(r, g, b);
+    }
 };
 #pragma pack(pop)
 
@@ -66,6 +75,11 @@ public:
     inline uint8_t g() const { return m_g; };
     inline uint8_t b() const { return m_b; };
 
+    // 4 bits per channel extended to 8
+    inline Color color() const {
+        return Color(m_r * 17, m_g * 17, m_b * 17);
+    }
+
     inline void assign(uint8_t r, uint8_t g, uint8_t b) {
         m_r = r;
         m_g = g;
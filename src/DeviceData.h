@@ -0,0 +1,108 @@
+#ifndef QILBM_DEVICE_DATA_H
+#define QILBM_DEVICE_DATA_H
+#pragma once
+
+#include <QtCore/QIODevice>
+#include <QtCore/QFileDevice>
+#include <QtCore/QByteArray>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "StreamReader.h"
+
+namespace qilbm {
+
+// The contents of a QIODevice from its current position to the end. Files are
+// memory mapped for as long as this object lives, anything else (or a file
+// that can't be mapped) is read into a buffer. Either way the device is
+// positioned at its end afterwards, like after readAll().
+class DeviceData {
+private:
+    QFileDevice* m_file;
+    uchar* m_map;
+    QByteArray m_buffer;
+    const uint8_t* m_data;
+    size_t m_size;
+
+public:
+    // True if the device is a file that DeviceData would memory map.
+    static bool can_map(QIODevice* device) {
+        auto* file = qobject_cast<QFileDevice*>(device);
+        return file != nullptr && !file->isSequential();
+    }
+
+    explicit DeviceData(QIODevice* device) :
+        m_file(nullptr), m_map(nullptr), m_buffer(), m_data(nullptr), m_size(0) {
+        auto* file = qobject_cast<QFileDevice*>(device);
+        if (file != nullptr && !file->isSequential()) {
+            const qint64 pos = file->pos();
+            const qint64 size = file->size() - pos;
+            if (size > 0) {
+                uchar* map = file->map(pos, size);
+                if (map != nullptr) {
+                    file->seek(pos + size);
+                    m_file = file;
+                    m_map = map;
+                    m_data = map;
+                    m_size = (size_t)size;
+                    return;
+                }
+            }
+        }
+
+        m_buffer = device->readAll();
+        m_data = (const uint8_t*)m_buffer.constData();
+        m_size = (size_t)m_buffer.size();
+    }
+
+    ~DeviceData() {
+        if (m_map != nullptr) {
+            m_file->unmap(m_map);
+        }
+    }
+
+    DeviceData(const DeviceData&) = delete;
+    DeviceData& operator=(const DeviceData&) = delete;
+
+    inline const uint8_t* data() const { return m_data; }
+    inline size_t size() const { return m_size; }
+    inline bool is_mapped() const { return m_map != nullptr; }
+};
+
+// Reads from a QIODevice as the data arrives, for devices that can't be
+// mapped (sockets, pipes, network replies, ...).
+class QIODeviceReader : public StreamReader {
+private:
+    QIODevice* m_device;
+    int m_timeout;
+
+public:
+    explicit QIODeviceReader(QIODevice* device, int timeout = 30000) :
+        m_device(device), m_timeout(timeout) {}
+
+    size_t read(uint8_t* buffer, size_t len) override {
+        size_t offset = 0;
+        while (offset < len) {
+            const qint64 count = m_device->read((char*)buffer + offset, (qint64)(len - offset));
+            if (count < 0) {
+                break;
+            }
+            if (count == 0 && !m_device->waitForReadyRead(m_timeout)) {
+                break;
+            }
+            offset += (size_t)count;
+        }
+        return offset;
+    }
+
+    bool skip(size_t len) override {
+        if (m_device->isSequential()) {
+            return StreamReader::skip(len);
+        }
+        return m_device->skip((qint64)len) == (qint64)len;
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,79 @@
+#include "HAM.h"
+
+#include <cstring>
+
+using namespace qilbm;
+
+template<size_t PixelLen>
+static void ham_decode_row(const uint32_t* keep, const uint32_t* set, uint32_t black, const uint8_t* codes, size_t width, uint8_t* pixels) {
+    if (width == 0) {
+        return;
+    }
+
+    uint32_t pixel = black;
+    const size_t last = width - 1;
+
+    // for RGB888 whole words are stored, the 4th byte is overwritten by the next pixel
+    for (size_t x = 0; x < last; ++ x) {
+        const uint8_t code = codes[x];
+        pixel = (pixel & keep[code]) | set[code];
+        std::memcpy(pixels + x * PixelLen, &pixel, 4);
+    }
+
+    const uint8_t code = codes[last];
+    pixel = (pixel & keep[code]) | set[code];
+    std::memcpy(pixels + last * PixelLen, &pixel, PixelLen);
+}
+
+uint32_t HAMDecoder::pack(uint8_t r, uint8_t g, uint8_t b, uint8_t a) const {
+    if (m_argb) {
+        return ((uint32_t)a << 24) | ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
+    }
+
+    const uint8_t bytes[4] = { r, g, b, a };
+    uint32_t value;
+    std::memcpy(&value, bytes, sizeof(value));
+    return value;
+}
+
+HAMDecoder::HAMDecoder(uint8_t num_planes, size_t pixel_len, bool argb) :
+    m_keep(), m_set(), m_black(0), m_payload_bits(num_planes - 2), m_argb(argb),
+    m_decode_row(pixel_len == 4 ? &ham_decode_row<4> : &ham_decode_row<3>) {
+    const uint8_t ham_shift = 8 - m_payload_bits;
+    const uint8_t ham_mask = (1 << ham_shift) - 1;
+    const size_t payload_count = (size_t)1 << m_payload_bits;
+
+    m_black = pack(0, 0, 0, 255);
+
+    // codes with bits above num_planes don't change the pixel
+    m_keep.fill(0xFFFFFFFF);
+    m_set.fill(0);
+
+    for (size_t color_index = 0; color_index < payload_count; ++ color_index) {
+        const uint8_t value = color_index << ham_shift;
+
+        // base color, see set_palette()
+        m_keep[color_index] = 0;
+        m_set[color_index] = m_black;
+
+        // blue
+        m_keep[payload_count + color_index] = pack(0xFF, 0xFF, ham_mask, 0xFF);
+        m_set[payload_count + color_index] = pack(0, 0, value, 0);
+
+        // red
+        m_keep[payload_count * 2 + color_index] = pack(ham_mask, 0xFF, 0xFF, 0xFF);
+        m_set[payload_count * 2 + color_index] = pack(value, 0, 0, 0);
+
+        // green
+        m_keep[payload_count * 3 + color_index] = pack(0xFF, ham_mask, 0xFF, 0xFF);
+        m_set[payload_count * 3 + color_index] = pack(0, value, 0, 0);
+    }
+}
+
+void HAMDecoder::set_palette(const Palette& palette) {
+    const size_t payload_count = (size_t)1 << m_payload_bits;
+    for (size_t color_index = 0; color_index < payload_count; ++ color_index) {
+        const auto& color = palette[color_index];
+        m_set[color_index] = pack(color.r(), color.g(), color.b(), 255);
+    }
+}
@@ -0,0 +1,50 @@
+#ifndef QILBM_HAM_H
+#define QILBM_HAM_H
+#pragma once
+
+#include <array>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "Palette.h"
+
+namespace qilbm {
+
+// Decodes rows of HAM (hold and modify) codes.
+//
+// Every possible code maps to the bits of the previous pixel it keeps and the
+// bits it sets, so a pixel is one AND and one OR with no branches. Pixels are
+// 32 bit in one of the layouts of PackedPalette. Only the entries of the base
+// colors depend on the palette, so switching the palette between rows (SHAM,
+// CTBL) just rewrites those.
+// See: http://www.etwright.org/lwsdk/docs/filefmts/ilbm.html
+class HAMDecoder {
+public:
+    typedef void (*DecodeRow)(const uint32_t* keep, const uint32_t* set, uint32_t black, const uint8_t* codes, size_t width, uint8_t* pixels);
+
+private:
+    std::array<uint32_t, 256> m_keep;
+    std::array<uint32_t, 256> m_set;
+    uint32_t m_black;
+    uint8_t m_payload_bits;
+    bool m_argb;
+    DecodeRow m_decode_row;
+
+    uint32_t pack(uint8_t r, uint8_t g, uint8_t b, uint8_t a) const;
+
+public:
+    // `num_planes` is 4 to 8, `pixel_len` 3 (RGB888) or 4 (RGBA8888, or
+    // 0xAARRGGBB words if `argb` is set).
+    HAMDecoder(uint8_t num_planes, size_t pixel_len, bool argb = false);
+
+    void set_palette(const Palette& palette);
+
+    // Each row starts out black.
+    inline void decode_row(const uint8_t* codes, size_t width, uint8_t* pixels) const {
+        m_decode_row(m_keep.data(), m_set.data(), m_black, codes, width, pixels);
+    }
+};
+
+}
+
+#endif
@@ -1,13 +1,42 @@
 #include "ILBM.h"
 #include "Debug.h"
 #include "Try.h"
+#include "C2P.h"
+#include "ThreadPool.h"
+#include "HAM.h"
 #include <cstring>
 #include <cassert>
+#include <atomic>
+#include <type_traits>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
 
 #define GET_UINT16(BUF, INDEX) (((uint16_t)((BUF)[(INDEX)]) << 8) | (uint16_t)((BUF)[(INDEX) + 1]))
 #define GET_UINT32(PTR) (((uint32_t)((PTR)[0]) << 24) | ((uint32_t)((PTR)[1]) << 16) | ((uint32_t)((PTR)[2]) << 8) | (uint32_t)((PTR)[3]))
 #define EXTEND_4_TO_8_BIT(X) ((X) * 17)
 
+// smaller images are decoded in the calling thread
+#define PARALLEL_MIN_BYTES (256 * 1024)
+
+// first step of the buffer chunk data of a stream is read into, it doubles
+// from there
+#define STREAM_READ_STEP (64 * 1024)
+
+// mask plane byte to 8 alpha values, leftmost pixel in the most significant bit
+static constexpr std::array<std::array<uint8_t, 8>, 256> make_mask_alpha_table() {
+    std::array<std::array<uint8_t, 8>, 256> table {};
+    for (size_t byte = 0; byte < 256; ++ byte) {
+        for (size_t bit = 0; bit < 8; ++ bit) {
+            table[byte][bit] = (byte >> (7 - bit)) & 1 ? 255 : 0;
+        }
+    }
+    return table;
+}
+
+static constexpr auto MASK_ALPHA_TABLE = make_mask_alpha_table();
+
 // generated with make_lookup_tables.py
 static const uint8_t COLOR_LOOKUP_TABLE_1BIT[] = { 0, 255 };
 static const uint8_t COLOR_LOOKUP_TABLE_2BITS[] = { 0, 85, 170, 255 };
@@ -146,7 +175,111 @@ bool ILBM::can_read(MemoryReader& reader) {
     return true;
 }
 
-Result ILBM::read(MemoryReader& reader, bool only_metadata) {
+void ILBM::reset() {
+    m_body = nullptr;
+    m_cmap = nullptr;
+    m_ctbl = nullptr;
+    m_sham = nullptr;
+    m_pchg = nullptr;
+    m_crngs.clear();
+    m_ccrts.clear();
+    m_camg = std::nullopt;
+    m_dycp = std::nullopt;
+    m_name = std::nullopt;
+    m_auth = std::nullopt;
+    m_anno = std::nullopt;
+    m_copy = std::nullopt;
+    m_chunks.clear();
+    m_source = nullptr;
+    m_pending = 0;
+    m_lazy_result = Result_Ok;
+}
+
+// Chunks that are only needed for rendering. When reading only metadata
+// just their first n bytes are parsed. Returns SIZE_MAX for other chunks.
+static size_t header_only_size(const std::array<char, 4>& fourcc) {
+    if (std::memcmp(fourcc.data(), "CTBL", 4) == 0) {
+        return CTBL::HEADER_SIZE;
+    } else if (std::memcmp(fourcc.data(), "SHAM", 4) == 0) {
+        return SHAM::HEADER_SIZE;
+    } else if (std::memcmp(fourcc.data(), "PCHG", 4) == 0) {
+        return PCHG::HEADER_SIZE;
+    }
+    return SIZE_MAX;
+}
+
+// Errors are never fatal here, this is only used for metadata.
+Result ILBM::read_chunk_header(const std::array<char, 4>& fourcc, MemoryReader& chunk_reader, size_t chunk_len) {
+    if (std::memcmp(fourcc.data(), "CTBL", 4) == 0) {
+        m_ctbl = std::make_unique<CTBL>();
+        PASS_IF(true, m_ctbl->read_header(chunk_reader, chunk_len), { m_ctbl = nullptr; });
+    } else if (std::memcmp(fourcc.data(), "SHAM", 4) == 0) {
+        m_sham = std::make_unique<SHAM>();
+        PASS_IF(true, m_sham->read_header(chunk_reader, chunk_len), { m_sham = nullptr; });
+    } else if (std::memcmp(fourcc.data(), "PCHG", 4) == 0) {
+        m_pchg = std::make_unique<PCHG>();
+        PASS_IF(true, m_pchg->read_header(chunk_reader, chunk_len), { m_pchg = nullptr; });
+    }
+
+    return Result_Ok;
+}
+
+Result ILBM::read_chunk(const std::array<char, 4>& fourcc, MemoryReader& chunk_reader, bool only_metadata) {
+    if (std::memcmp(fourcc.data(), "BMHD", 4) == 0) {
+        TRY(m_bmhd.read(chunk_reader));
+    } else if (std::memcmp(fourcc.data(), "BODY", 4) == 0) {
+        if (!only_metadata) {
+            m_body = std::make_unique<BODY>();
+            TRY(m_body->read(chunk_reader, m_file_type, m_bmhd));
+        }
+    } else if (std::memcmp(fourcc.data(), "CMAP", 4) == 0) {
+        m_cmap = std::make_unique<CMAP>();
+        PASS_IF(only_metadata, m_cmap->read(chunk_reader), { m_cmap = nullptr; });
+    } else if (std::memcmp(fourcc.data(), "CRNG", 4) == 0) {
+        CRNG& crng = m_crngs.emplace_back();
+        PASS_IF(only_metadata, crng.read(chunk_reader), { m_crngs.pop_back(); });
+    } else if (std::memcmp(fourcc.data(), "CCRT", 4) == 0) {
+        CCRT& ccrt = m_ccrts.emplace_back();
+        PASS_IF(only_metadata, ccrt.read(chunk_reader), { m_ccrts.pop_back(); });
+    } else if (std::memcmp(fourcc.data(), "CAMG", 4) == 0) {
+        CAMG& camg = m_camg.emplace();
+        PASS_IF(only_metadata, camg.read(chunk_reader), { m_camg = std::nullopt; });
+    } else if (std::memcmp(fourcc.data(), "DYCP", 4) == 0) {
+        DYCP& dycp = m_dycp.emplace();
+        PASS_IF(only_metadata, dycp.read(chunk_reader), { m_dycp = std::nullopt; });
+    } else if (only_metadata && header_only_size(fourcc) != SIZE_MAX) {
+        TRY(read_chunk_header(fourcc, chunk_reader, chunk_reader.remaining()));
+    } else if (std::memcmp(fourcc.data(), "CTBL", 4) == 0) {
+        m_ctbl = std::make_unique<CTBL>();
+        PASS_IF(only_metadata, m_ctbl->read(chunk_reader), { m_ctbl = nullptr; });
+    } else if (std::memcmp(fourcc.data(), "SHAM", 4) == 0) {
+        m_sham = std::make_unique<SHAM>();
+        PASS_IF(only_metadata, m_sham->read(chunk_reader), { m_sham = nullptr; });
+    } else if (std::memcmp(fourcc.data(), "PCHG", 4) == 0) {
+        m_pchg = std::make_unique<PCHG>();
+        PASS_IF(only_metadata, m_pchg->read(chunk_reader), { m_pchg = nullptr; });
+    } else if (std::memcmp(fourcc.data(), "NAME", 4) == 0) {
+        NAME& name = m_name.emplace();
+        PASS_IF(only_metadata, name.read(chunk_reader), { m_name = std::nullopt; });
+    } else if (std::memcmp(fourcc.data(), "AUTH", 4) == 0) {
+        AUTH& auth = m_auth.emplace();
+        PASS_IF(only_metadata, auth.read(chunk_reader), { m_auth = std::nullopt; });
+    } else if (std::memcmp(fourcc.data(), "ANNO", 4) == 0) {
+        ANNO& anno = m_anno.emplace();
+        PASS_IF(only_metadata, anno.read(chunk_reader), { m_anno = std::nullopt; });
+    } else if (std::memcmp(fourcc.data(), "(c) ", 4) == 0) {
+        Copy& copy = m_copy.emplace();
+        PASS_IF(only_metadata, copy.read(chunk_reader), { m_copy = std::nullopt; });
+    } else {
+        // ignore unknown chunk
+        // TODO: HAM, SHAM, ...
+    }
+
+    return Result_Ok;
+}
+
+template<typename Reader>
+Result ILBM::read_form_header(Reader& reader, uint32_t& main_chunk_len) {
     std::array<char, 4> fourcc;
     IO(reader.read_fourcc(fourcc));
 
@@ -157,7 +290,6 @@ Result ILBM::read(MemoryReader& reader, bool only_metadata) {
         return Result_Unsupported;
     }
 
-    uint32_t main_chunk_len = 0;
     IO(reader.read_u32be(main_chunk_len));
 
     if (main_chunk_len < BMHD::SIZE + 4) {
@@ -178,20 +310,57 @@ Result ILBM::read(MemoryReader& reader, bool only_metadata) {
         return Result_Unsupported;
     }
 
-    m_body = nullptr;
-    m_cmap = nullptr;
-    m_ctbl = nullptr;
-    m_sham = nullptr;
-    m_pchg = nullptr;
-    m_crngs.clear();
-    m_ccrts.clear();
-    m_camg = std::nullopt;
-    m_dycp = std::nullopt;
-    m_name = std::nullopt;
-    m_auth = std::nullopt;
-    m_anno = std::nullopt;
-    m_copy = std::nullopt;
+    return Result_Ok;
+}
+
+Result ILBM::read(MemoryReader& reader, bool only_metadata) {
+    uint32_t main_chunk_len = 0;
+    TRY(read_form_header(reader, main_chunk_len));
+
+    reset();
+
+    MemoryReader main_chunk_reader { reader, main_chunk_len - 4 };
+    return read_chunks(main_chunk_reader, main_chunk_len - 4, only_metadata);
+}
+
+// Which LazyChunk flag a chunk is loaded with, 0 for chunks that scan()
+// parses right away or doesn't know.
+uint32_t ILBM::lazy_chunk_flag(const std::array<char, 4>& fourcc) {
+    static const struct {
+        const char* fourcc;
+        uint32_t flag;
+    } LAZY_CHUNKS[] = {
+        { "NAME", LazyChunk_NAME },
+        { "AUTH", LazyChunk_AUTH },
+        { "ANNO", LazyChunk_ANNO },
+        { "(c) ", LazyChunk_Copy },
+        { "DYCP", LazyChunk_DYCP },
+        { "BODY", LazyChunk_BODY },
+        { "CMAP", LazyChunk_CMAP },
+        { "CTBL", LazyChunk_CTBL },
+        { "SHAM", LazyChunk_SHAM },
+        { "PCHG", LazyChunk_PCHG },
+        { "CRNG", LazyChunk_CRNG },
+        { "CCRT", LazyChunk_CCRT },
+    };
+
+    for (const auto& chunk : LAZY_CHUNKS) {
+        if (std::memcmp(fourcc.data(), chunk.fourcc, 4) == 0) {
+            return chunk.flag;
+        }
+    }
+    return 0;
+}
+
+Result ILBM::scan(MemoryReader& reader) {
+    uint32_t main_chunk_len = 0;
+    TRY(read_form_header(reader, main_chunk_len));
 
+    reset();
+
+    m_source = reader.begin();
+
+    std::array<char, 4> fourcc;
     MemoryReader main_chunk_reader { reader, main_chunk_len - 4 };
     while (main_chunk_reader.remaining() > 0) {
         IO(main_chunk_reader.read_fourcc(fourcc));
@@ -199,149 +368,265 @@ Result ILBM::read(MemoryReader& reader, bool only_metadata) {
         IO(main_chunk_reader.read_u32be(chunk_len));
         MemoryReader chunk_reader { main_chunk_reader, chunk_len };
 
-        // std::printf("CHUNK: %c%c%c%c\n", fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+        m_chunks.push_back(ChunkInfo {
+            fourcc,
+            (size_t)(chunk_reader.begin() - m_source),
+            chunk_reader.size(),
+        });
 
-        if (std::memcmp(fourcc.data(), "BMHD", 4) == 0) {
-            TRY(m_bmhd.read(chunk_reader));
-        } else if (std::memcmp(fourcc.data(), "BODY", 4) == 0) {
-            if (!only_metadata) {
-                m_body = std::make_unique<BODY>();
-                TRY(m_body->read(chunk_reader, m_file_type, m_bmhd));
-            }
-        } else if (std::memcmp(fourcc.data(), "CMAP", 4) == 0) {
-            m_cmap = std::make_unique<CMAP>();
-            PASS_IF(only_metadata, m_cmap->read(chunk_reader), { m_cmap = nullptr; });
-        } else if (std::memcmp(fourcc.data(), "CRNG", 4) == 0) {
-            CRNG& crng = m_crngs.emplace_back();
-            PASS_IF(only_metadata, crng.read(chunk_reader), { m_crngs.pop_back(); });
-        } else if (std::memcmp(fourcc.data(), "CCRT", 4) == 0) {
-            CCRT& ccrt = m_ccrts.emplace_back();
-            PASS_IF(only_metadata, ccrt.read(chunk_reader), { m_ccrts.pop_back(); });
-        } else if (std::memcmp(fourcc.data(), "CAMG", 4) == 0) {
-            CAMG& camg = m_camg.emplace();
-            PASS_IF(only_metadata, camg.read(chunk_reader), { m_camg = std::nullopt; });
-        } else if (std::memcmp(fourcc.data(), "DYCP", 4) == 0) {
-            DYCP& dycp = m_dycp.emplace();
-            PASS_IF(only_metadata, dycp.read(chunk_reader), { m_dycp = std::nullopt; });
-        } else if (std::memcmp(fourcc.data(), "CTBL", 4) == 0) {
-            m_ctbl = std::make_unique<CTBL>();
-            PASS_IF(only_metadata, m_ctbl->read(chunk_reader), { m_ctbl = nullptr; });
-        } else if (std::memcmp(fourcc.data(), "SHAM", 4) == 0) {
-            m_sham = std::make_unique<SHAM>();
-            PASS_IF(only_metadata, m_sham->read(chunk_reader), { m_sham = nullptr; });
-        } else if (std::memcmp(fourcc.data(), "PCHG", 4) == 0) {
-            m_pchg = std::make_unique<PCHG>();
-            PASS_IF(only_metadata, m_pchg->read(chunk_reader), { m_pchg = nullptr; });
-        } else if (std::memcmp(fourcc.data(), "NAME", 4) == 0) {
-            NAME& name = m_name.emplace();
-            PASS_IF(only_metadata, name.read(chunk_reader), { m_name = std::nullopt; });
-        } else if (std::memcmp(fourcc.data(), "AUTH", 4) == 0) {
-            AUTH& auth = m_auth.emplace();
-            PASS_IF(only_metadata, auth.read(chunk_reader), { m_auth = std::nullopt; });
-        } else if (std::memcmp(fourcc.data(), "ANNO", 4) == 0) {
-            ANNO& anno = m_anno.emplace();
-            PASS_IF(only_metadata, anno.read(chunk_reader), { m_anno = std::nullopt; });
-        } else if (std::memcmp(fourcc.data(), "(c) ", 4) == 0) {
-            Copy& copy = m_copy.emplace();
-            PASS_IF(only_metadata, copy.read(chunk_reader), { m_copy = std::nullopt; });
-        } else {
-            // ignore unknown chunk
-            // TODO: HAM, SHAM, ...
+        if (std::memcmp(fourcc.data(), "BMHD", 4) == 0 || std::memcmp(fourcc.data(), "CAMG", 4) == 0) {
+            TRY(read_chunk(fourcc, chunk_reader, false));
         }
 
         chunk_len += chunk_len & 1;
         main_chunk_reader.seek_relative(chunk_len);
     }
 
-    bool laced = false;
-    if (m_camg) {
-        auto viewport_mode = m_camg->viewport_mode();
-        if (viewport_mode & CAMG::EHB) {
-            if (!m_cmap) {
-                m_cmap = std::make_unique<CMAP>();
-            }
+    m_pending = LazyChunk_All;
+
+    return Result_Ok;
+}
+
+Result ILBM::load_all() {
+    load(LazyChunk_All);
+    m_source = nullptr;
+
+    return m_lazy_result;
+}
+
+Result ILBM::load_all_but_body() {
+    load(LazyChunk_All & ~LazyChunk_BODY);
+
+    return m_lazy_result;
+}
+
+bool ILBM::has_pending_body() const {
+    if ((m_pending & LazyChunk_BODY) == 0) {
+        return false;
+    }
+
+    for (const auto& chunk : m_chunks) {
+        if (std::memcmp(chunk.fourcc.data(), "BODY", 4) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+Result ILBM::decode_body(const BODY::Rows& rows) const {
+    if ((m_pending & LazyChunk_BODY) == 0) {
+        LOG_DEBUG("BODY chunk isn't pending");
+        return Result_ParsingError;
+    }
+
+    // like when loading them, the last BODY chunk wins
+    for (auto chunk = m_chunks.rbegin(); chunk != m_chunks.rend(); ++ chunk) {
+        if (std::memcmp(chunk->fourcc.data(), "BODY", 4) == 0) {
+            MemoryReader chunk_reader { m_source + chunk->offset, chunk->length };
+            return BODY::decode(chunk_reader, m_file_type, m_bmhd, rows);
+        }
+    }
+
+    LOG_DEBUG("no BODY chunk");
+    return Result_ParsingError;
+}
+
+void ILBM::load_pending(uint32_t chunks) {
+    m_pending &= ~chunks;
+
+    for (const auto& chunk : m_chunks) {
+        const uint32_t flag = lazy_chunk_flag(chunk.fourcc);
+        if ((flag & chunks) == 0) {
+            continue;
+        }
+
+        MemoryReader chunk_reader { m_source + chunk.offset, chunk.length };
+        const Result result = read_chunk(chunk.fourcc, chunk_reader, false);
+        if (result != Result_Ok) {
+            LOG_DEBUG("error parsing %c%c%c%c chunk: %s",
+                chunk.fourcc[0], chunk.fourcc[1], chunk.fourcc[2], chunk.fourcc[3],
+                result_name(result));
 
-            auto& colors = m_cmap->colors();
-            if (colors.size() < 64) {
-                colors.resize(64, Color(0, 0, 0));
+            if (flag == LazyChunk_BODY) {
+                m_body = nullptr;
             }
 
-            for (size_t index = 32; index < 64; ++ index) {
-                auto color = colors[index - 32];
-                colors[index] = Color(color.r() >> 1, color.g() >> 1, color.b() >> 1);
+            if (m_lazy_result == Result_Ok) {
+                m_lazy_result = result;
             }
         }
+    }
 
-        if (viewport_mode & CAMG::HAM) {
-            if (!m_cmap) {
-                // HAM might access the palette, ensure it exists if HAM is true
-                m_cmap = std::make_unique<CMAP>();
-            }
+    if (chunks & LazyChunk_CMAP) {
+        finish_cmap();
+    }
+}
+
+// Chunks that read_chunk() does something with. Others are skipped without
+// loading them when reading from a stream.
+static bool is_known_chunk(const std::array<char, 4>& fourcc) {
+    static const char* const KNOWN_CHUNKS[] = {
+        "BMHD", "BODY", "CMAP", "CRNG", "CCRT", "CAMG", "DYCP",
+        "CTBL", "SHAM", "PCHG", "NAME", "AUTH", "ANNO", "(c) ",
+    };
+
+    for (const char* name : KNOWN_CHUNKS) {
+        if (std::memcmp(fourcc.data(), name, 4) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Reads up to len bytes into `buffer` with read(data, count), which returns
+// how many bytes it got. Lengths come from the file, so the buffer grows with
+// the data that actually arrives instead of being allocated up front. Stops
+// at the first short read and returns the number of bytes read.
+template<typename Read>
+static size_t read_in_steps(std::vector<uint8_t>& buffer, size_t len, Read read) {
+    size_t size = 0;
+    while (size < len) {
+        const size_t step = size < STREAM_READ_STEP ? STREAM_READ_STEP : size;
+        const size_t count = step < len - size ? step : len - size;
+        if (buffer.size() < size + count) {
+            buffer.resize(size + count);
         }
 
-        if (viewport_mode & CAMG::LACE) {
-            laced = true;
+        const size_t actual = read(buffer.data() + size, count);
+        size += actual;
+        if (actual < count) {
+            break;
         }
     }
+    buffer.resize(size);
 
-    if (m_ctbl || m_sham) {
-        auto palette = this->palette();
+    return size;
+}
 
-        if (m_ctbl) {
-            auto& palettes = m_ctbl->palettes();
+// Up to len bytes of chunk data, fewer if the file ends before. Those in
+// memory aren't copied, others are read into `buffer`.
+static MemoryReader read_chunk_data(MemoryReader& reader, size_t len, std::vector<uint8_t>&) {
+    const MemoryReader chunk_reader = reader.slice(len);
+    reader.seek_relative(chunk_reader.size());
+    return chunk_reader;
+}
 
-            if (palette) {
-                const auto palette_begin = palette->data().begin() + 16;
-                const auto palette_end = palette->data().end();
-                for (auto& pal : palettes) {
-                    std::copy(palette_begin, palette_end, pal.data().begin() + 16);
-                }
-            }
+static MemoryReader read_chunk_data(StreamReader& reader, size_t len, std::vector<uint8_t>& buffer) {
+    read_in_steps(buffer, len, [&](uint8_t* data, size_t count) {
+        return reader.read(data, count);
+    });
+    return MemoryReader { buffer.data(), buffer.size() };
+}
 
-            if (palettes.size() < (size_t)m_bmhd.height()) {
-                LOG_DEBUG(
-                    "fewer CTBL palettes than rows in image, extending with zeroed palettes: %zu < %u",
-                    palettes.size(), m_bmhd.height());
+// A BODY chunk of len bytes. From a stream it is decoded row by row through a
+// bounded buffer.
+static Result read_body_chunk(MemoryReader& reader, size_t len, BODY& body, FileType file_type, const BMHD& bmhd, bool& truncated) {
+    MemoryReader body_reader = reader.slice(len);
+    truncated = !reader.skip(len);
+    return body.read(body_reader, file_type, bmhd);
+}
 
-                if (palette) {
-                    palettes.resize((size_t)m_bmhd.height(), *palette);
-                } else {
-                    palettes.resize((size_t)m_bmhd.height());
-                }
-            }
-        }
+static Result read_body_chunk(StreamReader& reader, size_t len, BODY& body, FileType file_type, const BMHD& bmhd, bool& truncated) {
+    BufferedReader body_reader { reader, len };
+    TRY(body.read(body_reader, file_type, bmhd));
+    truncated = !body_reader.skip_rest();
+    return Result_Ok;
+}
 
-        if (m_sham) {
-            auto& palettes = m_sham->palettes();
+Result ILBM::read(StreamReader& reader, bool only_metadata) {
+    uint32_t main_chunk_len = 0;
+    TRY(read_form_header(reader, main_chunk_len));
 
-            if (palette) {
-                const auto palette_begin = palette->data().begin() + 16;
-                const auto palette_end = palette->data().end();
-                for (auto& pal : palettes) {
-                    std::copy(palette_begin, palette_end, pal.data().begin() + 16);
-                }
-            }
+    reset();
 
-            size_t height = m_bmhd.height();
-            size_t palette_count = laced ? (height + 1) / 2 : height;
+    return read_chunks(reader, main_chunk_len - 4, only_metadata);
+}
 
-            if (palettes.size() < palette_count) {
-                LOG_DEBUG(
-                    "fewer SHAM palettes than expected, extending with zeroed palettes: %zu < %zu",
-                    palettes.size(), palette_count);
+// Chunks are cut off at the end of the main chunk and a truncated file ends
+// the chunk list instead of failing. Only known chunks are loaded.
+template<typename Reader>
+Result ILBM::read_chunks(Reader& reader, size_t main_remaining, bool only_metadata) {
+    std::array<char, 4> fourcc;
+    std::vector<uint8_t> chunk_data;
+    bool truncated = false;
 
-                if (palette) {
-                    palettes.resize(palette_count, *palette);
-                } else {
-                    palettes.resize(palette_count);
-                }
-            }
+    while (main_remaining > 0 && !truncated) {
+        MemoryReader header_reader = read_chunk_data(reader, main_remaining < 8 ? main_remaining : 8, chunk_data);
+        if (header_reader.is_empty()) {
+            // file ends right after a chunk
+            break;
+        }
+        IO(header_reader.read_fourcc(fourcc));
+        uint32_t chunk_len = 0;
+        IO(header_reader.read_u32be(chunk_len));
+        main_remaining -= 8;
+
+        const size_t chunk_size = chunk_len < main_remaining ? chunk_len : main_remaining;
+        main_remaining -= chunk_size;
+
+        // std::printf("CHUNK: %c%c%c%c\n", fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+
+        const bool is_body = std::memcmp(fourcc.data(), "BODY", 4) == 0;
+        if (is_body && !only_metadata) {
+            m_body = std::make_unique<BODY>();
+            TRY(read_body_chunk(reader, chunk_size, *m_body, m_file_type, m_bmhd, truncated));
+        } else if (only_metadata && header_only_size(fourcc) != SIZE_MAX) {
+            const size_t header_size = header_only_size(fourcc);
+            const size_t load_size = header_size < chunk_size ? header_size : chunk_size;
+            MemoryReader chunk_reader = read_chunk_data(reader, load_size, chunk_data);
+            truncated = chunk_reader.size() < load_size || !reader.skip(chunk_size - load_size);
+
+            TRY(read_chunk_header(fourcc, chunk_reader, chunk_size));
+        } else if (!is_body && is_known_chunk(fourcc)) {
+            MemoryReader chunk_reader = read_chunk_data(reader, chunk_size, chunk_data);
+            truncated = chunk_reader.size() < chunk_size;
+
+            TRY(read_chunk(fourcc, chunk_reader, only_metadata));
+        } else {
+            truncated = !reader.skip(chunk_size);
+        }
+
+        if ((chunk_len & 1) && main_remaining > 0 && !truncated) {
+            truncated = !reader.skip(1);
+            -- main_remaining;
         }
     }
 
+    finish_cmap();
+
     return Result_Ok;
 }
 
+void ILBM::finish_cmap() {
+    if (!m_camg) {
+        return;
+    }
+
+    auto viewport_mode = m_camg->viewport_mode();
+    if (viewport_mode & CAMG::EHB) {
+        if (!m_cmap) {
+            m_cmap = std::make_unique<CMAP>();
+        }
+
+        auto& colors = m_cmap->colors();
+        if (colors.size() < 64) {
+            colors.resize(64, Color(0, 0, 0));
+        }
+
+        for (size_t index = 32; index < 64; ++ index) {
+            auto color = colors[index - 32];
+            colors[index] = Color(color.r() >> 1, color.g() >> 1, color.b() >> 1);
+        }
+    }
+
+    if (viewport_mode & CAMG::HAM) {
+        if (!m_cmap) {
+            // HAM might access the palette, ensure it exists if HAM is true
+            m_cmap = std::make_unique<CMAP>();
+        }
+    }
+}
+
 Result CMAP::read(MemoryReader& reader) {
     size_t num_colors = reader.remaining() / 3;
 
@@ -462,7 +747,267 @@ void CCRT::print(std::FILE* file) const {
     );
 }
 
-Result BODY::read(MemoryReader& reader, FileType file_type, const BMHD& header) {
+// Unpacks one ByteRun1 compressed row of exactly row_len bytes, from memory
+// or pulling the compressed bytes from a stream. Every byte of the row is
+// written, so no zero filling is needed.
+template<typename Reader>
+static Result unpack_byterun1(Reader& reader, uint8_t* row, size_t row_len) {
+    size_t pos = 0;
+
+    while (pos < row_len) {
+        uint8_t cmd = 0;
+        IO(reader.read_u8(cmd));
+
+        if (cmd < 128) {
+            const size_t count = (size_t)cmd + 1;
+            const size_t next_pos = pos + count;
+            if (next_pos > row_len) {
+                LOG_DEBUG("broken BODY compression, more data than fits into row: %zu > %zu", next_pos, row_len);
+                return Result_ParsingError;
+            }
+            IO(reader.read(row + pos, count));
+            pos = next_pos;
+        } else if (cmd > 128) {
+            const size_t count = 257 - (size_t)cmd;
+            uint8_t value = 0;
+            IO(reader.read_u8(value));
+            const size_t next_pos = pos + count;
+            if (next_pos > row_len) {
+                LOG_DEBUG("broken BODY compression, more data than fits into row: %zu > %zu", next_pos, row_len);
+                return Result_ParsingError;
+            }
+            std::memset(row + pos, value, count);
+            pos = next_pos;
+        } else {
+            // some sources says 128 is EOF, other say its NOP
+        }
+    }
+
+    return Result_Ok;
+}
+
+// Records where each ByteRun1 compressed row starts (relative to the current
+// reader position) without unpacking anything, so the rows can be unpacked
+// independently. Moves the reader past the last row.
+static Result scan_byterun1_rows(MemoryReader& reader, size_t row_len, size_t row_count, std::vector<size_t>& row_offsets) {
+    const uint8_t* const start = reader.current();
+    const uint8_t* const end = start + reader.remaining();
+    const uint8_t* input = start;
+
+    row_offsets.resize(row_count);
+    for (size_t y = 0; y < row_count; ++ y) {
+        row_offsets[y] = (size_t)(input - start);
+
+        size_t pos = 0;
+        while (pos < row_len) {
+            if (input >= end) {
+                LOG_DEBUG("truncated compressed BODY chunk at row %zu", y);
+                return Result_IOError;
+            }
+            const uint8_t cmd = *input ++;
+
+            size_t count;
+            size_t data_len;
+            if (cmd < 128) {
+                count = (size_t)cmd + 1;
+                data_len = count;
+            } else if (cmd > 128) {
+                count = 257 - (size_t)cmd;
+                data_len = 1;
+            } else {
+                // some sources says 128 is EOF, other say its NOP
+                continue;
+            }
+
+            const size_t next_pos = pos + count;
+            if (next_pos > row_len) {
+                LOG_DEBUG("broken BODY compression, more data than fits into row: %zu > %zu", next_pos, row_len);
+                return Result_ParsingError;
+            }
+            if ((size_t)(end - input) < data_len) {
+                LOG_DEBUG("truncated compressed BODY chunk: %zu < %zu", (size_t)(end - input), data_len);
+                return Result_IOError;
+            }
+            input += data_len;
+            pos = next_pos;
+        }
+    }
+
+    reader.seek_relative(input - start);
+    return Result_Ok;
+}
+
+// Unpacks one VDAT chunk (the column major words of one plane) into the
+// uncompressed BODY layout. `plane` points to the plane in the first row, rows
+// are `line_len` bytes apart. Words past the last column are ignored.
+static Result unpack_vdat(MemoryReader& reader, uint8_t* plane, size_t line_len, size_t column_count, size_t height) {
+    uint16_t cmd_cnt = 0;
+    IO(reader.read_u16be(cmd_cnt));
+
+    if (cmd_cnt < 2) {
+        LOG_DEBUG("error in VDAT, cmd_cnt < 2: %u", cmd_cnt);
+        return Result_ParsingError;
+    }
+    cmd_cnt -= 2;
+    size_t data_offset = cmd_cnt;
+    const uint8_t *buf = reader.current();
+    const size_t buf_len = reader.remaining();
+    if (cmd_cnt > buf_len) {
+        LOG_DEBUG("truncated compressed BODY chunk: %u > %zu", cmd_cnt, buf_len);
+        return Result_ParsingError;
+    }
+
+    if (height == 0) {
+        return Result_Ok;
+    }
+
+    size_t x = 0;
+    size_t y = 0;
+    uint8_t* out = plane;
+
+    // advances down the column, then to the top of the next one
+    auto next_word = [&]() {
+        ++ y;
+        out += line_len;
+        if (y == height) {
+            y = 0;
+            ++ x;
+            out = plane + x * 2;
+        }
+    };
+
+    auto copy_words = [&](const uint8_t* words, size_t count) {
+        for (size_t index = 0; index < count && x < column_count; ++ index) {
+            out[0] = words[index * 2];
+            out[1] = words[index * 2 + 1];
+            next_word();
+        }
+    };
+
+    auto fill_words = [&](const uint8_t* word, size_t count) {
+        const uint8_t hi = word[0];
+        const uint8_t lo = word[1];
+        for (size_t index = 0; index < count && x < column_count; ++ index) {
+            out[0] = hi;
+            out[1] = lo;
+            next_word();
+        }
+    };
+
+    for (size_t cmd_index = 0; cmd_index < cmd_cnt && x < column_count; ++ cmd_index) {
+        int8_t cmd = buf[cmd_index];
+
+        if (cmd == 0 || cmd == 1) { // load count from data
+            size_t next_offset = data_offset + 2;
+            if (next_offset > buf_len) {
+                LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
+                return Result_ParsingError;
+            }
+            const size_t count = GET_UINT16(buf, data_offset);
+            data_offset = next_offset;
+
+            if (cmd == 0) { // COPY
+                next_offset += count * 2;
+                if (next_offset > buf_len) {
+                    LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
+                    return Result_ParsingError;
+                }
+                copy_words(buf + data_offset, count);
+            } else { // RLE
+                next_offset += 2;
+                if (next_offset > buf_len) {
+                    LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
+                    return Result_ParsingError;
+                }
+                fill_words(buf + data_offset, count);
+            }
+            data_offset = next_offset;
+        } else if (cmd < 0) { // count = -cmd, COPY
+            const size_t count = -(int_fast32_t)cmd;
+            const size_t next_offset = data_offset + count * 2;
+            if (next_offset > buf_len) {
+                LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
+                return Result_ParsingError;
+            }
+            copy_words(buf + data_offset, count);
+            data_offset = next_offset;
+        } else { // cmd > 1: count = cmd, RLE
+            const size_t count = cmd;
+            const size_t next_offset = data_offset + 2;
+            if (next_offset > buf_len) {
+                LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
+                return Result_ParsingError;
+            }
+            fill_words(buf + data_offset, count);
+            data_offset = next_offset;
+        }
+
+        if (data_offset >= buf_len) {
+            break;
+        }
+    }
+
+    return Result_Ok;
+}
+
+// BODY::decode() hands on rows in blocks of this many
+#define BODY_ROW_BLOCK 32
+
+// Where a range of BODY rows is decoded to: straight into the pixel data of
+// the BODY, or for BODY::decode() into a small buffer that is handed on
+// every BODY_ROW_BLOCK rows.
+class BodyRows {
+private:
+    const BODY::Rows* m_rows;
+    uint8_t* m_pixels;
+    uint8_t* m_alpha;
+    size_t m_row_byte_len;
+    size_t m_width;
+    size_t m_block_begin;
+    size_t m_block_len;
+    size_t m_end;
+    std::vector<uint8_t> m_pixel_buffer;
+    std::vector<uint8_t> m_alpha_buffer;
+
+public:
+    BodyRows(const BODY::Rows* rows, uint8_t* pixels, uint8_t* alpha, bool masked, size_t row_byte_len, size_t width, size_t begin, size_t end) :
+        m_rows(rows), m_pixels(pixels), m_alpha(alpha), m_row_byte_len(row_byte_len), m_width(width),
+        m_block_begin(begin), m_block_len(0), m_end(end), m_pixel_buffer(), m_alpha_buffer() {
+        if (rows) {
+            m_block_len = end - begin < BODY_ROW_BLOCK ? end - begin : BODY_ROW_BLOCK;
+            m_pixel_buffer.resize(m_block_len * row_byte_len, 0);
+            m_pixels = m_pixel_buffer.data();
+
+            if (masked) {
+                // rows without mask data (VDAT) stay opaque
+                m_alpha_buffer.resize(m_block_len * width, 255);
+                m_alpha = m_alpha_buffer.data();
+            }
+        }
+    }
+
+    inline uint8_t* pixels(size_t y) {
+        return m_pixels + (m_rows ? y - m_block_begin : y) * m_row_byte_len;
+    }
+
+    inline uint8_t* alpha(size_t y) {
+        return m_alpha ? m_alpha + (m_rows ? y - m_block_begin : y) * m_width : nullptr;
+    }
+
+    // Rows have to be done in order.
+    inline void row_done(size_t y) {
+        if (m_rows && (y + 1 - m_block_begin == m_block_len || y + 1 == m_end)) {
+            (*m_rows)(m_block_begin, y + 1, m_pixels, m_alpha);
+            m_block_begin = y + 1;
+
+            if (m_alpha) {
+                std::memset(m_alpha, 255, m_alpha_buffer.size());
+            }
+        }
+    }
+};
+
+Result BODY::check(FileType file_type, const BMHD& header) {
     const size_t num_planes = header.num_planes();
     switch (num_planes) {
         case 1:
@@ -478,90 +1023,202 @@ Result BODY::read(MemoryReader& reader, FileType file_type, const BMHD& header)
                 return Result_Unsupported;
             }
     }
-    const size_t width = header.width();
-    const size_t height = header.height();
-    const size_t pixel_count = width * height;
 
-    const size_t plane_len = (width + 15) / 16 * 2;
-    size_t line_len = num_planes * plane_len;
-    if (header.mask() == 1) {
-        line_len += plane_len;
-    }
-    std::vector<uint8_t> line;
-    line.resize(line_len, 0);
+    return Result_Ok;
+}
 
-    const size_t data_len = height * line_len;
-    const size_t pixel_byte_len = pixel_count * ((num_planes + 7) / 8);
+Result BODY::init(FileType file_type, const BMHD& header) {
+    TRY(check(file_type, header));
+
+    const size_t num_planes = header.num_planes();
+    const size_t pixel_count = (size_t)header.width() * (size_t)header.height();
+    const size_t pixel_len = (num_planes + 7) / 8;
 
-    m_data.reserve(pixel_byte_len);
+    m_data.clear();
+    m_data.resize(pixel_count * pixel_len, 0);
+
+    // one alpha value per pixel, rows without mask data (VDAT) stay opaque
+    m_mask.clear();
     if (header.mask() == 1) {
-        m_mask.reserve(pixel_count);
+        m_mask.resize(pixel_count, 255);
     }
 
-    switch (header.compression()) {
-        case 0:
-            // uncompressed
-            if (data_len > reader.remaining()) {
-                LOG_DEBUG("truncated BODY chunk: %zu < %zu", reader.remaining(), data_len);
-                return Result_ParsingError;
-            }
+    return Result_Ok;
+}
+
+// Points `data` at the next len bytes of a BODY chunk, false if it is too
+// short. Those of a chunk in memory aren't copied, others are read into
+// `buffer`.
+static bool read_body_data(MemoryReader& reader, size_t len, std::vector<uint8_t>&, const uint8_t*& data) {
+    data = reader.current();
+    return reader.skip(len);
+}
+
+static bool read_body_data(BufferedReader& reader, size_t len, std::vector<uint8_t>& buffer, const uint8_t*& data) {
+    const size_t size = read_in_steps(buffer, len, [&](uint8_t* chunk, size_t count) {
+        return reader.read(chunk, count) ? count : 0;
+    });
+    data = buffer.data();
+    return size == len;
+}
+
+Result BODY::read(MemoryReader& reader, FileType file_type, const BMHD& header) {
+    TRY(init(file_type, header));
 
-            for (uint16_t y = 0; y < header.height(); ++ y) {
-                IO(reader.read(line));
-                decode_line(line, header.mask(), header.width(), plane_len, num_planes, file_type);
+    return decode_rows(reader, file_type, header, m_data.data(), m_mask.empty() ? nullptr : m_mask.data(), nullptr);
+}
+
+Result BODY::read(BufferedReader& reader, FileType file_type, const BMHD& header) {
+    TRY(init(file_type, header));
+
+    return decode_rows(reader, file_type, header, m_data.data(), m_mask.empty() ? nullptr : m_mask.data(), nullptr);
+}
+
+Result BODY::decode(MemoryReader& reader, FileType file_type, const BMHD& header, const Rows& rows) {
+    TRY(check(file_type, header));
+
+    return decode_rows(reader, file_type, header, nullptr, nullptr, &rows);
+}
+
+template<typename Reader>
+Result BODY::decode_rows(Reader& reader, FileType file_type, const BMHD& header, uint8_t* pixels, uint8_t* alpha, const Rows* rows) {
+    // Uncompressed and ByteRun1 rows can only be unpacked in parallel if the
+    // whole chunk is in memory, a stream is decoded row by row.
+    constexpr bool in_memory = std::is_same_v<Reader, MemoryReader>;
+
+    const size_t num_planes = header.num_planes();
+    const size_t width = header.width();
+    const size_t height = header.height();
+    const bool masked = header.mask() == 1;
+
+    const size_t plane_len = (width + 15) / 16 * 2;
+    size_t line_len = num_planes * plane_len;
+    if (masked) {
+        line_len += plane_len;
+    }
+    std::vector<uint8_t> line;
+    line.resize(line_len, 0);
+
+    const size_t data_len = height * line_len;
+    const size_t pixel_len = (num_planes + 7) / 8;
+    const size_t row_byte_len = width * pixel_len;
+    const size_t pixel_byte_len = height * row_byte_len;
+
+    const bool parallel = pixel_byte_len >= PARALLEL_MIN_BYTES && thread_count() > 1;
+
+    auto body_rows = [&](size_t begin, size_t end) {
+        return BodyRows { rows, pixels, alpha, masked, row_byte_len, width, begin, end };
+    };
+
+    switch (header.compression()) {
+        case 0:
+        {
+            // uncompressed
+            if (data_len > reader.remaining()) {
+                LOG_DEBUG("truncated BODY chunk: %zu < %zu", reader.remaining(), data_len);
+                return Result_ParsingError;
+            }
+
+            if constexpr (in_memory) {
+                if (parallel) {
+                    const uint8_t* data = reader.current();
+                    parallel_for(height, [&](size_t begin, size_t end) {
+                        BodyRows out = body_rows(begin, end);
+                        for (size_t y = begin; y < end; ++ y) {
+                            decode_line(data + y * line_len, out.pixels(y), out.alpha(y), header.width(), plane_len, num_planes, file_type);
+                            out.row_done(y);
+                        }
+                    });
+                    reader.seek_relative(data_len);
+                    break;
+                }
             }
-            break;
 
+            BodyRows out = body_rows(0, height);
+            for (size_t y = 0; y < height; ++ y) {
+                const uint8_t* data = nullptr;
+                IO(read_body_data(reader, line_len, line, data));
+                decode_line(data, out.pixels(y), out.alpha(y), header.width(), plane_len, num_planes, file_type);
+                out.row_done(y);
+            }
+            break;
+        }
         case 1:
+        {
             // compressed
             if (file_type == FileType_PBM) {
                 // XXX: why only here and not also in uncompressed?
                 line_len = width;
             }
-            for (uint_fast16_t y = 0; y < header.height(); ++ y) {
-                size_t pos = 0;
-                uint8_t cmd = 0;
-                while (pos < line_len) {
-                    IO(reader.read_u8(cmd));
-                    if (cmd < 128) {
-                        size_t count = (size_t)cmd + 1;
-                        size_t next_pos = pos + count;
-                        if (next_pos > line_len) {
-                            LOG_DEBUG("broken BODY compression, more data than fits into row: %zu > %zu", next_pos, line_len);
-                            return Result_ParsingError;
+            // chunky rows without a mask are unpacked straight into the pixel data
+            const bool direct = file_type == FileType_PBM && num_planes == 8 && !masked;
+
+            if constexpr (in_memory) {
+                if (parallel) {
+                    const MemoryReader body_reader { reader };
+                    std::vector<size_t> row_offsets;
+                    TRY(scan_byterun1_rows(reader, line_len, height, row_offsets));
+
+                    std::atomic<bool> failed { false };
+                    parallel_for(height, [&](size_t begin, size_t end) {
+                        BodyRows out = body_rows(begin, end);
+                        std::vector<uint8_t> row_line;
+                        if (!direct) {
+                            // not line_len, PBM rows might still be followed by a mask plane
+                            row_line.resize(line.size(), 0);
                         }
-                        IO(reader.read(line.data() + pos, count));
-                        pos = next_pos;
-                    } else if (cmd > 128) {
-                        size_t count = 257 - (size_t)cmd;
-                        uint8_t value;
-                        IO(reader.read_u8(value));
-                        size_t next_pos = pos + count;
-                        if (next_pos > line_len) {
-                            LOG_DEBUG("broken BODY compression, more data than fits into row: %zu > %zu", next_pos, line_len);
-                            return Result_ParsingError;
+
+                        // rows of one range are consecutive
+                        MemoryReader row_reader { body_reader };
+                        row_reader.seek_relative((ssize_t)row_offsets[begin]);
+
+                        for (size_t y = begin; y < end; ++ y) {
+                            uint8_t* row = direct ? out.pixels(y) : row_line.data();
+                            if (unpack_byterun1(row_reader, row, line_len) != Result_Ok) {
+                                failed.store(true, std::memory_order_relaxed);
+                                return;
+                            }
+                            if (!direct) {
+                                decode_line(row, out.pixels(y), out.alpha(y), header.width(), plane_len, num_planes, file_type);
+                            }
+                            out.row_done(y);
                         }
-                        std::fill(line.data() + pos, line.data() + next_pos, value);
-                        pos = next_pos;
-                    } else {
-                        // some sources says 128 is EOF, other say its NOP
+                    });
+
+                    if (failed.load(std::memory_order_relaxed)) {
+                        // can't really happen, scan_byterun1_rows() already checked everything
+                        LOG_DEBUG("error while decompressing BODY rows in parallel, height: %zu", height);
+                        return Result_ParsingError;
                     }
-                    assert(pos <= line_len);
-                    std::fill(line.data() + pos, line.data() + line_len, 0);
+                    break;
                 }
-                decode_line(line, header.mask(), header.width(), plane_len, num_planes, file_type);
             }
-            break;
 
+            BodyRows out = body_rows(0, height);
+            for (size_t y = 0; y < height; ++ y) {
+                if (direct) {
+                    TRY(unpack_byterun1(reader, out.pixels(y), line_len));
+                } else {
+                    TRY(unpack_byterun1(reader, line.data(), line_len));
+                    decode_line(line.data(), out.pixels(y), out.alpha(y), header.width(), plane_len, num_planes, file_type);
+                }
+                out.row_done(y);
+            }
+            break;
+        }
         case 2:
         {
             // VDAT compression
-            m_data.resize(pixel_byte_len, 0);
-
             std::array<char, 4> fourcc;
-            std::vector<uint8_t> buf;
-            std::vector<uint8_t> decompr;
-            decompr.reserve(pixel_byte_len);
+
+            // The plane words are unpacked into their place in the uncompressed
+            // BODY layout, so the rows can be converted like uncompressed ones.
+            // The mask plane, if any, is not part of VDAT and stays zero.
+            // Column major, so nothing can be converted before the last plane
+            // is read. From a stream only one VDAT chunk is held at a time.
+            std::vector<uint8_t> planar;
+            planar.resize(data_len, 0);
+            std::vector<uint8_t> sub_chunk;
 
             for (size_t plane_index = 0; plane_index < num_planes; ++ plane_index) {
                 IO(reader.read_fourcc(fourcc));
@@ -580,134 +1237,30 @@ Result BODY::read(MemoryReader& reader, FileType file_type, const BMHD& header)
                     return Result_ParsingError;
                 }
 
-                MemoryReader sub_reader { reader, (size_t)sub_chunk_len };
-                uint16_t cmd_cnt = 0;
-                IO(sub_reader.read_u16be(cmd_cnt));
+                const uint8_t* sub_data = nullptr;
+                IO(read_body_data(reader, sub_chunk_len, sub_chunk, sub_data));
 
-                if (cmd_cnt < 2) {
-                    LOG_DEBUG("error in VDAT, cmd_cnt < 2: %u", cmd_cnt);
-                    return Result_ParsingError;
-                }
-                cmd_cnt -= 2;
-                size_t data_offset = cmd_cnt;
-                const uint8_t *buf = sub_reader.data() + sub_reader.offset();
-                const size_t buf_len = sub_reader.remaining();
-                if (cmd_cnt > buf_len) {
-                    LOG_DEBUG("truncated compressed BODY chunk: %u > %zu", cmd_cnt, buf_len);
-                    return Result_ParsingError;
-                }
+                MemoryReader sub_reader { sub_data, (size_t)sub_chunk_len };
+                TRY(unpack_vdat(sub_reader, planar.data() + plane_index * plane_len, line_len, plane_len / 2, height));
 
-                decompr.clear();
-                for (size_t cmd_index = 0; cmd_index < cmd_cnt; ++ cmd_index) {
-                    int8_t cmd = buf[cmd_index];
-
-                    if (cmd == 0) { // load count from data, COPY
-                        size_t next_offset = data_offset + 2;
-                        if (next_offset < data_offset) {
-                            LOG_DEBUG("overflow while decompressing BODY chunk: %zu < %zu", next_offset, data_offset);
-                            return Result_ParsingError;
-                        }
-                        if (next_offset > buf_len) {
-                            LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
-                            return Result_ParsingError;
-                        }
-                        size_t count = GET_UINT16(buf, data_offset);
-
-                        data_offset = next_offset;
-                        next_offset += count * 2;
-                        if (next_offset < data_offset) {
-                            LOG_DEBUG("overflow while decompressing BODY chunk: %zu < %zu", next_offset, data_offset);
-                            return Result_ParsingError;
-                        }
-                        if (next_offset > buf_len) {
-                            LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
-                            return Result_ParsingError;
-                        }
-
-                        std::copy(buf + data_offset, buf + next_offset, std::back_inserter(decompr));
-                        data_offset = next_offset;
-                    } else if (cmd == 1) { // load count from data, RLE
-                        size_t next_offset = data_offset + 2;
-                        if (next_offset < data_offset) {
-                            LOG_DEBUG("overflow while decompressing BODY chunk: %zu < %zu", next_offset, data_offset);
-                            return Result_ParsingError;
-                        }
-                        if (next_offset > buf_len) {
-                            LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
-                            return Result_ParsingError;
-                        }
-                        uint_fast16_t count = GET_UINT16(buf, data_offset);
-
-                        data_offset = next_offset;
-                        next_offset += 2;
-                        if (next_offset < data_offset) {
-                            LOG_DEBUG("overflow while decompressing BODY chunk: %zu < %zu", next_offset, data_offset);
-                            return Result_ParsingError;
-                        }
-                        if (next_offset > buf_len) {
-                            LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
-                            return Result_ParsingError;
-                        }
-
-                        for (uint_fast16_t rle_index = 0; rle_index < count; ++ rle_index) {
-                            decompr.emplace_back(buf[data_offset]);
-                            decompr.emplace_back(buf[data_offset + 1]);
-                        }
-                        data_offset = next_offset;
-                    } else if (cmd < 0) { // count = -cmd, COPY
-                        size_t count = -(int_fast32_t)cmd;
-                        size_t next_offset = data_offset + count * 2;
-                        if (next_offset < data_offset) {
-                            LOG_DEBUG("overflow while decompressing BODY chunk: %zu < %zu", next_offset, data_offset);
-                            return Result_ParsingError;
-                        }
-                        if (next_offset > buf_len) {
-                            LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
-                            return Result_ParsingError;
-                        }
-
-                        std::copy(buf + data_offset, buf + next_offset, std::back_inserter(decompr));
-                        data_offset = next_offset;
-                    } else { // cmd > 1: count = cmd, RLE
-                        size_t count = cmd;
-                        size_t next_offset = data_offset + 2;
-                        if (next_offset < data_offset) {
-                            LOG_DEBUG("overflow while decompressing BODY chunk: %zu < %zu", next_offset, data_offset);
-                            return Result_ParsingError;
-                        }
-                        if (next_offset > buf_len) {
-                            LOG_DEBUG("truncated compressed BODY chunk: %zu > %zu", next_offset, buf_len);
-                            return Result_ParsingError;
-                        }
-
-                        for (uint_fast16_t rle_index = 0; rle_index < count; ++ rle_index) {
-                            decompr.emplace_back(buf[data_offset]);
-                            decompr.emplace_back(buf[data_offset + 1]);
-                        }
-                        data_offset = next_offset;
-                    }
-                    if (data_offset >= buf_len) {
-                        break;
-                    }
+                if (sub_chunk_len & 1) {
+                    // IFF chunks are padded to an even size
+                    reader.skip(1);
                 }
+            }
 
-                // TODO: fix 24 and 32 bit support
-                for (size_t byte_index = 0; byte_index < decompr.size(); ++ byte_index) {
-                    uint8_t value = decompr[byte_index];
-                    size_t word_index = byte_index / 2;
-                    size_t x = (word_index / height) * 16 + 8 * (byte_index & 1);
-                    size_t y = word_index % height;
-
-                    for (uint8_t bit = 0; bit < 8; ++ bit) {
-                        size_t pixel_index = y * width + x + bit;
-                        if (pixel_index >= m_data.size()) {
-                            break;
-                        }
-                        m_data[pixel_index] |= ((value >> (7 - bit)) & 1) << plane_index;
-                    }
+            auto convert_rows = [&](size_t begin, size_t end) {
+                BodyRows out = body_rows(begin, end);
+                for (size_t y = begin; y < end; ++ y) {
+                    planar_to_chunky(planar.data() + y * line_len, plane_len, num_planes, width, out.pixels(y));
+                    out.row_done(y);
                 }
+            };
 
-                reader.seek_relative(sub_chunk_len);
+            if (parallel) {
+                parallel_for(height, convert_rows);
+            } else {
+                convert_rows(0, height);
             }
             break;
         }
@@ -716,49 +1269,13 @@ Result BODY::read(MemoryReader& reader, FileType file_type, const BMHD& header)
             return Result_Unsupported;
     }
 
-    if (header.mask() == 1 && m_mask.size() < pixel_count) {
-        LOG_DEBUG("mask == 1, but didn't read enough mask bits: %zu < %zu", m_mask.size(), pixel_count);
-        m_mask.resize(pixel_count, true);
-    }
-
     return Result_Ok;
 }
 
-void BODY::decode_line(const std::vector<uint8_t>& line, uint8_t mask, uint16_t width, size_t plane_len, size_t num_planes, FileType file_type) {
+void BODY::decode_line(const uint8_t* line, uint8_t* pixels, uint8_t* alpha, uint16_t width, size_t plane_len, size_t num_planes, FileType file_type) {
     switch (file_type) {
         case FileType_ILBM:
-            if (num_planes == 24 || num_planes == 32) {
-                uint_fast16_t channels = num_planes / 8;
-                size_t channel_len = (size_t)plane_len * 8;
-
-                for (uint_fast16_t x = 0; x < width; ++ x) {
-                    auto byte_offset = x / 8;
-                    auto bit_offset = x % 8;
-                    for (uint_fast16_t channel = 0; channel < channels; ++ channel) {
-                        size_t offset = channel * channel_len + byte_offset;
-                        uint8_t value = 0;
-                        for (uint_fast16_t plane_index = 0; plane_index < 8; ++ plane_index) {
-                            size_t byte_index = offset + plane_len * plane_index;
-                            assert(byte_index < line.size());
-                            uint8_t bit = (line[byte_index] >> (7 - bit_offset)) & 1;
-                            value |= bit << plane_index;
-                        }
-                        m_data.emplace_back(value);
-                    }
-                }
-            } else {
-                for (uint_fast16_t x = 0; x < width; ++ x) {
-                    size_t byte_offset = x / 8;
-                    auto bit_offset = x % 8;
-                    uint8_t value = 0;
-                    for (size_t plane_index = 0; plane_index < num_planes; ++ plane_index) {
-                        size_t byte_index = plane_len * plane_index + byte_offset;
-                        uint8_t bit = (line[byte_index] >> (7 - bit_offset)) & 1;
-                        value |= bit << plane_index;
-                    }
-                    m_data.emplace_back(value);
-                }
-            }
+            planar_to_chunky(line, plane_len, num_planes, width, pixels);
             break;
 
         case FileType_PBM:
@@ -769,20 +1286,21 @@ void BODY::decode_line(const std::vector<uint8_t>& line, uint8_t mask, uint16_t
                     // XXX: don't know about the bit order!
                     for (uint_fast16_t index = 0; index < width / 8; ++ index) {
                         uint8_t byte = line[index];
-                        m_data.emplace_back(byte & 1);
-                        m_data.emplace_back((byte > 1) & 1);
-                        m_data.emplace_back((byte > 2) & 1);
-                        m_data.emplace_back((byte > 3) & 1);
-                        m_data.emplace_back((byte > 4) & 1);
-                        m_data.emplace_back((byte > 5) & 1);
-                        m_data.emplace_back((byte > 6) & 1);
-                        m_data.emplace_back((byte > 7) & 1);
+                        pixels[0] = byte & 1;
+                        pixels[1] = (byte >> 1) & 1;
+                        pixels[2] = (byte >> 2) & 1;
+                        pixels[3] = (byte >> 3) & 1;
+                        pixels[4] = (byte >> 4) & 1;
+                        pixels[5] = (byte >> 5) & 1;
+                        pixels[6] = (byte >> 6) & 1;
+                        pixels[7] = (byte >> 7) & 1;
+                        pixels += 8;
                     }
                     uint_fast16_t rem = width % 8;
                     if (rem > 0) {
                         uint8_t byte = line[width / 8];
                         for (uint_fast16_t bit_index = 0; bit_index < rem; ++ bit_index) {
-                            m_data.emplace_back((byte >> bit_index) & 1);
+                            pixels[bit_index] = (byte >> bit_index) & 1;
                         }
                     }
                     break;
@@ -791,21 +1309,25 @@ void BODY::decode_line(const std::vector<uint8_t>& line, uint8_t mask, uint16_t
                     // XXX: don't know about the nibble order!
                     for (uint_fast16_t index = 0; index < width / 2; ++ index) {
                         uint8_t byte = line[index];
-                        m_data.emplace_back(byte & 0xF);
-                        m_data.emplace_back(byte >> 4);
+                        pixels[0] = byte & 0xF;
+                        pixels[1] = byte >> 4;
+                        pixels += 2;
+                    }
+                    if (width & 1) {
+                        pixels[0] = line[width / 2] & 0xF;
                     }
                     break;
 
                 case 8:
-                    std::copy(line.data(), line.data() + width, std::back_inserter(m_data));
+                    std::memcpy(pixels, line, width);
                     break;
 
                 case 24:
-                    std::copy(line.data(), line.data() + (size_t)width * 3, std::back_inserter(m_data));
+                    std::memcpy(pixels, line, (size_t)width * 3);
                     break;
 
                 case 32:
-                    std::copy(line.data(), line.data() + (size_t)width * 4, std::back_inserter(m_data));
+                    std::memcpy(pixels, line, (size_t)width * 4);
                     break;
             }
             break;
@@ -816,15 +1338,17 @@ void BODY::decode_line(const std::vector<uint8_t>& line, uint8_t mask, uint16_t
             break;
     }
 
-    if (mask == 1) {
-        size_t offset = plane_len * num_planes;
-        // inefficient, do 8 at a time except for last < 8
-        for (uint16_t index = 0; index < width; ++ index) {
-            uint8_t octet = line[offset + (size_t)index];
-            uint16_t bit_offset = index % 8;
-            // TODO: check bit order, might be different for PBM
-            bool value = (octet >> (7 - bit_offset)) & 1;
-            m_mask.emplace_back(value);
+    if (alpha) {
+        // TODO: check bit order, might be different for PBM
+        const uint8_t* mask = line + plane_len * num_planes;
+        const size_t full_bytes = width / 8;
+        for (size_t index = 0; index < full_bytes; ++ index) {
+            std::memcpy(alpha + index * 8, MASK_ALPHA_TABLE[mask[index]].data(), 8);
+        }
+
+        const size_t rem = width % 8;
+        if (rem > 0) {
+            std::memcpy(alpha + full_bytes * 8, MASK_ALPHA_TABLE[mask[full_bytes]].data(), rem);
         }
     }
 }
@@ -843,26 +1367,26 @@ Result DYCP::read(MemoryReader& reader) {
     return Result_Ok;
 }
 
+Result CTBL::read_header(MemoryReader&, size_t chunk_len) {
+    m_palette_count = chunk_len / 32;
+    m_palettes.clear();
+
+    return Result_Ok;
+}
+
 Result CTBL::read(MemoryReader& reader) {
     size_t palette_count = reader.remaining() / 32;
     const uint8_t* data = reader.current();
+    m_palette_count = palette_count;
     m_palettes.clear();
 
+    m_palettes.resize(palette_count);
+
     size_t offset = 0;
-    for (size_t palette_index = 0; palette_index < palette_count; ++ palette_index) {
-        auto& palette = m_palettes.emplace_back();
+    for (auto& palette : m_palettes) {
         for (uint_fast8_t color_index = 0; color_index < 16; ++ color_index) {
-            uint8_t v1 = data[offset];
-            uint8_t v2 = data[offset + 1];
-            uint8_t r = v1 & 0xF;
-            uint8_t g = v2 >> 4;
-            uint8_t b = v2 & 0xF;
-
-            palette[color_index].assign(
-                EXTEND_4_TO_8_BIT(r),
-                EXTEND_4_TO_8_BIT(g),
-                EXTEND_4_TO_8_BIT(b)
-            );
+            // 0x0RGB
+            palette[color_index].assign((uint16_t)GET_UINT16(data, offset));
             offset += 2;
         }
     }
@@ -870,28 +1394,29 @@ Result CTBL::read(MemoryReader& reader) {
     return Result_Ok;
 }
 
+Result SHAM::read_header(MemoryReader& reader, size_t chunk_len) {
+    IO(reader.read_u16be(m_version));
+    m_palette_count = (chunk_len - HEADER_SIZE) / 32;
+    m_palettes.clear();
+
+    return Result_Ok;
+}
+
 Result SHAM::read(MemoryReader& reader) {
     IO(reader.read_u16be(m_version));
 
     size_t palette_count = reader.remaining() / 32;
     const uint8_t* data = reader.current();
+    m_palette_count = palette_count;
     m_palettes.clear();
 
+    m_palettes.resize(palette_count);
+
     size_t offset = 0;
-    for (size_t palette_index = 0; palette_index < palette_count; ++ palette_index) {
-        auto& palette = m_palettes.emplace_back();
+    for (auto& palette : m_palettes) {
         for (uint_fast8_t color_index = 0; color_index < 16; ++ color_index) {
-            uint8_t v1 = data[offset];
-            uint8_t v2 = data[offset + 1];
-            uint8_t r = v1 & 0xF;
-            uint8_t g = v2 >> 4;
-            uint8_t b = v2 & 0xF;
-
-            palette[color_index].assign(
-                EXTEND_4_TO_8_BIT(r),
-                EXTEND_4_TO_8_BIT(g),
-                EXTEND_4_TO_8_BIT(b)
-            );
+            // 0x0RGB
+            palette[color_index].assign((uint16_t)GET_UINT16(data, offset));
             offset += 2;
         }
     }
@@ -899,7 +1424,7 @@ Result SHAM::read(MemoryReader& reader) {
     return Result_Ok;
 }
 
-Result PCHG::read(MemoryReader& reader) {
+Result PCHG::read_header(MemoryReader& reader, size_t) {
     IO(reader.read_u16be(m_compression));
     IO(reader.read_u16be(m_flags));
     IO(reader.read_i16be(m_start_line));
@@ -915,6 +1440,82 @@ Result PCHG::read(MemoryReader& reader) {
         return Result_ParsingError;
     }
 
+    m_line_mask.clear();
+    m_changes.clear();
+
+    return Result_Ok;
+}
+
+// The Huffman tree of PCHG is made of big endian 16 bit words and walked
+// backwards from the last one. Takes one step from the word at `pos` (offset
+// from `tree_start`) for `bit`. Returns 1 and the symbol at a leaf, where
+// `pos` goes back to `root`, 0 if the walk goes on and -1 if it leaves the
+// tree.
+static inline int huffman_step(const uint8_t* tree_start, size_t root, size_t& pos, bool bit, uint8_t& symbol) {
+    if (bit) {
+        const int16_t value = (int16_t)GET_UINT16(tree_start, pos);
+        if (value >= 0) {
+            symbol = (uint8_t)value;
+            pos = root;
+            return 1;
+        }
+
+        if ((size_t)-(int32_t)value > pos) {
+            return -1;
+        }
+        pos -= (size_t)-(int32_t)value;
+    } else {
+        if (pos < 2) {
+            return -1;
+        }
+        pos -= 2;
+
+        const int16_t value = (int16_t)GET_UINT16(tree_start, pos);
+        if (value > 0 && (value & 0x100)) {
+            symbol = (uint8_t)value;
+            pos = root;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Codes of up to this many bits are decoded with one table lookup.
+static const uint32_t HUFFMAN_TABLE_BITS = 10;
+
+struct HuffmanEntry {
+    uint8_t symbol;
+    uint8_t length; // 0 if the code is longer than the table bits
+};
+
+// Walks the tree for every possible value of the next HUFFMAN_TABLE_BITS bits.
+static void build_huffman_table(const uint8_t* tree_start, size_t root, std::array<HuffmanEntry, 1 << HUFFMAN_TABLE_BITS>& table) {
+    for (uint32_t code = 0; code < table.size(); ++ code) {
+        auto& entry = table[code];
+        entry.symbol = 0;
+        entry.length = 0;
+
+        size_t pos = root;
+        for (uint32_t length = 1; length <= HUFFMAN_TABLE_BITS; ++ length) {
+            const bool bit = (code >> (HUFFMAN_TABLE_BITS - length)) & 1;
+            const int step = huffman_step(tree_start, root, pos, bit, entry.symbol);
+            if (step < 0) {
+                // left to the bit by bit walk, which reports the error
+                break;
+            }
+
+            if (step > 0) {
+                entry.length = length;
+                break;
+            }
+        }
+    }
+}
+
+Result PCHG::read(MemoryReader& reader) {
+    TRY(read_header(reader, reader.remaining()));
+
     switch (m_compression) {
         case COMP_NONE:
             return this->read_line_data(reader);
@@ -927,61 +1528,81 @@ Result PCHG::read(MemoryReader& reader) {
             IO(reader.read_u32be(comp_info_size));
             IO(reader.read_u32be(original_data_size));
 
-            std::vector<uint8_t> decompr {};
-            decompr.reserve(original_data_size);
+            if (comp_info_size < 2 || comp_info_size > reader.remaining()) {
+                LOG_DEBUG("PCHG: Illegal Huffman tree size: %u", comp_info_size);
+                return Result_ParsingError;
+            }
 
-            uint32_t index = 0;
-            uint32_t bits = 0;
-            uint32_t current = 0;
             const uint8_t *startptr = reader.current();
             const uint8_t *endptr = reader.end();
-            const uint8_t *tree = startptr + comp_info_size - 2;
+            const size_t tree = comp_info_size - 2;
             const uint8_t *source = startptr + comp_info_size;
-            const uint8_t *ptr = tree;
+
+            // every byte takes at least one bit
+            if ((uint64_t)original_data_size > (uint64_t)(endptr - source) * 8) {
+                LOG_DEBUG("Source buffer overflow while decompressing");
+                return Result_ParsingError;
+            }
+
+            std::array<HuffmanEntry, 1 << HUFFMAN_TABLE_BITS> table;
+            build_huffman_table(startptr, tree, table);
+
+            std::vector<uint8_t> decompr(original_data_size);
+
+            // Bits are taken from the top of `buffer`. It's refilled one 32 bit
+            // word at a time, data past the last whole word isn't used.
+            uint64_t buffer = 0;
+            uint32_t bits = 0;
+            uint32_t index = 0;
 
             while (index < original_data_size) {
-                if (!bits) {
-                    if (source + 4 > endptr) {
-                        LOG_DEBUG("Source buffer overflow while decompressing");
-                        return Result_ParsingError;
-                    }
-                    current = GET_UINT32(source);
+                if (bits <= 32 && source + 4 <= endptr) {
+                    buffer |= (uint64_t)GET_UINT32(source) << (32 - bits);
                     source += 4;
-                    bits = 32;
+                    bits += 32;
+                }
+
+                const auto& entry = table[buffer >> (64 - HUFFMAN_TABLE_BITS)];
+                if (entry.length != 0 && entry.length <= bits) {
+                    decompr[index] = entry.symbol;
+                    ++ index;
+                    buffer <<= entry.length;
+                    bits -= entry.length;
+                    continue;
                 }
-                if (current & 0x80000000) {
-                    int16_t value = (int16_t)GET_UINT16(ptr, 0);
-                    if (value >= 0) {
-                        decompr.emplace_back((uint8_t)value);
-                        ++ index;
-                        ptr = tree;
-                    } else {
-                        ptr += value;
 
-                        if (ptr < startptr) {
-                            LOG_DEBUG("Huffman tree underflow while decompressing");
+                // longer codes and the end of the data are walked bit by bit
+                size_t pos = tree;
+                for (;;) {
+                    if (bits == 0) {
+                        if (source + 4 > endptr) {
+                            LOG_DEBUG("Source buffer overflow while decompressing");
                             return Result_ParsingError;
                         }
+                        buffer = (uint64_t)GET_UINT32(source) << 32;
+                        source += 4;
+                        bits = 32;
                     }
-                } else {
-                    ptr -= 2;
-                    if (ptr < startptr) {
+
+                    const bool bit = (buffer >> 63) != 0;
+                    buffer <<= 1;
+                    -- bits;
+
+                    uint8_t symbol;
+                    const int step = huffman_step(startptr, tree, pos, bit, symbol);
+                    if (step < 0) {
                         LOG_DEBUG("Huffman tree underflow while decompressing");
                         return Result_ParsingError;
                     }
-                    int16_t value = (int16_t)GET_UINT16(ptr, 0);
-                    if (value > 0 && (value & 0x100)) {
-                        decompr.emplace_back((uint8_t)value);
+
+                    if (step > 0) {
+                        decompr[index] = symbol;
                         ++ index;
-                        ptr = tree;
+                        break;
                     }
                 }
-                current <<= 1;
-                -- bits;
             }
 
-            decompr.resize(original_data_size);
-
             MemoryReader line_reader(decompr.data(), original_data_size);
             return this->read_line_data(line_reader);
         }
@@ -996,55 +1617,25 @@ Result PCHG::read(MemoryReader& reader) {
 Result PCHG::read_line_data(MemoryReader& reader) {
     size_t mask_len = (m_line_count + 31) / 32;
 
-    m_line_mask.clear();
-    m_line_mask.reserve(mask_len * 4 * 8);
+    m_line_mask.resize(mask_len);
 
     for (size_t index = 0; index < mask_len; ++ index) {
-        uint32_t value;
-        IO(reader.read_u32be(value));
-
-        m_line_mask.emplace_back((value & (1 <<  0)) != 0);
-        m_line_mask.emplace_back((value & (1 <<  1)) != 0);
-        m_line_mask.emplace_back((value & (1 <<  2)) != 0);
-        m_line_mask.emplace_back((value & (1 <<  3)) != 0);
-        m_line_mask.emplace_back((value & (1 <<  4)) != 0);
-        m_line_mask.emplace_back((value & (1 <<  5)) != 0);
-        m_line_mask.emplace_back((value & (1 <<  6)) != 0);
-        m_line_mask.emplace_back((value & (1 <<  7)) != 0);
-
-        m_line_mask.emplace_back((value & (1 <<  8)) != 0);
-        m_line_mask.emplace_back((value & (1 <<  9)) != 0);
-        m_line_mask.emplace_back((value & (1 << 10)) != 0);
-        m_line_mask.emplace_back((value & (1 << 11)) != 0);
-        m_line_mask.emplace_back((value & (1 << 12)) != 0);
-        m_line_mask.emplace_back((value & (1 << 13)) != 0);
-        m_line_mask.emplace_back((value & (1 << 14)) != 0);
-        m_line_mask.emplace_back((value & (1 << 15)) != 0);
-
-        m_line_mask.emplace_back((value & (1 << 16)) != 0);
-        m_line_mask.emplace_back((value & (1 << 17)) != 0);
-        m_line_mask.emplace_back((value & (1 << 18)) != 0);
-        m_line_mask.emplace_back((value & (1 << 19)) != 0);
-        m_line_mask.emplace_back((value & (1 << 20)) != 0);
-        m_line_mask.emplace_back((value & (1 << 21)) != 0);
-        m_line_mask.emplace_back((value & (1 << 22)) != 0);
-        m_line_mask.emplace_back((value & (1 << 23)) != 0);
-
-        m_line_mask.emplace_back((value & (1 << 24)) != 0);
-        m_line_mask.emplace_back((value & (1 << 25)) != 0);
-        m_line_mask.emplace_back((value & (1 << 26)) != 0);
-        m_line_mask.emplace_back((value & (1 << 27)) != 0);
-        m_line_mask.emplace_back((value & (1 << 28)) != 0);
-        m_line_mask.emplace_back((value & (1 << 29)) != 0);
-        m_line_mask.emplace_back((value & (1 << 30)) != 0);
-        m_line_mask.emplace_back((value & (1 << 31)) != 0);
-    }
-
-    // truncate padding bits, if there are any
-    m_line_mask.resize(m_line_count, false);
+        IO(reader.read_u32be(m_line_mask[index]));
+    }
+
+    // clear padding bits, if there are any
+    if (m_line_count % 32) {
+        m_line_mask.back() &= ~(uint32_t)0 << (32 - m_line_count % 32);
+    }
+
+    // each change is at least 2 bytes, don't trust the header too much
+    const size_t max_changes = reader.remaining() / 2;
 
     m_changes.clear();
-    m_changes.reserve(m_changed_lines);
+    m_changes.reserve(m_total_changes < max_changes ? m_total_changes : max_changes);
+    m_line_offsets.clear();
+    m_line_offsets.reserve((size_t)m_changed_lines + 1);
+    m_line_offsets.push_back(0);
 
     const bool is_small = m_flags & FLAG_12BIT;
     const bool is_big   = m_flags & FLAG_32BIT;
@@ -1060,8 +1651,6 @@ Result PCHG::read_line_data(MemoryReader& reader) {
     }
 
     for (size_t line_index = 0; line_index < m_changed_lines; ++ line_index) {
-        auto& line_changes = m_changes.emplace_back();
-
         if (is_small) {
             uint8_t change_count16;
             uint8_t change_count32;
@@ -1069,8 +1658,6 @@ Result PCHG::read_line_data(MemoryReader& reader) {
             IO(reader.read_u8(change_count16));
             IO(reader.read_u8(change_count32));
 
-            line_changes.reserve((size_t)change_count16 + (size_t)change_count32);
-
             for (size_t change_index = 0; change_index < change_count16; ++ change_index) {
                 uint16_t value;
                 IO(reader.read_u16be(value));
@@ -1081,7 +1668,7 @@ Result PCHG::read_line_data(MemoryReader& reader) {
                     uint8_t g = EXTEND_4_TO_8_BIT((value & 0x00F0) >> 4);
                     uint8_t b = EXTEND_4_TO_8_BIT((value & 0x000F));
 
-                    line_changes.emplace_back(reg, Color(r, g, b));
+                    m_changes.emplace_back(reg, Color(r, g, b));
                 }
             }
 
@@ -1095,7 +1682,7 @@ Result PCHG::read_line_data(MemoryReader& reader) {
                     uint8_t g = EXTEND_4_TO_8_BIT((value & 0x00F0) >> 4);
                     uint8_t b = EXTEND_4_TO_8_BIT((value & 0x000F));
 
-                    line_changes.emplace_back(reg, Color(r, g, b));
+                    m_changes.emplace_back(reg, Color(r, g, b));
                 }
             }
         } else {
@@ -1103,8 +1690,6 @@ Result PCHG::read_line_data(MemoryReader& reader) {
 
             IO(reader.read_u32be(change_count));
 
-            line_changes.reserve(change_count);
-
             for (size_t change_index = 0; change_index < change_count; ++ change_index) {
                 uint16_t reg;
 
@@ -1124,10 +1709,12 @@ Result PCHG::read_line_data(MemoryReader& reader) {
                         return Result_Unsupported;
                     }
 
-                    line_changes.emplace_back(reg, Color(r, g, b));
+                    m_changes.emplace_back(reg, Color(r, g, b));
                 }
             }
         }
+
+        m_line_offsets.push_back(m_changes.size());
     }
 
     return Result_Ok;
@@ -1248,10 +1835,37 @@ std::unique_ptr<Palette> ILBM::palette() const {
     return palette;
 }
 
-Result Renderer::read(MemoryReader& reader) {
+void Renderer::reset() {
     m_palette = nullptr;
     m_cycles.clear();
     m_cycled_palette.clear();
+    m_cycle_offsets.clear();
+    m_cycle_pixels.clear();
+    m_changed_indices.clear();
+    m_frame_valid = false;
+    m_cycles_visible = false;
+    m_cached_palettes.clear();
+    m_frame_palette_indices.clear();
+    m_frame_cache_index = SIZE_MAX;
+}
+
+Result Renderer::read(MemoryReader& reader) {
+    reset();
+
+    Result result = m_image.read(reader);
+
+    if (result != Result_Ok) {
+        return result;
+    }
+
+    init();
+    init_body();
+
+    return result;
+}
+
+Result Renderer::read(StreamReader& reader) {
+    reset();
 
     Result result = m_image.read(reader);
 
@@ -1259,16 +1873,52 @@ Result Renderer::read(MemoryReader& reader) {
         return result;
     }
 
+    init();
+    init_body();
+
+    return result;
+}
+
+Result Renderer::scan(MemoryReader& reader) {
+    reset();
+
+    TRY(m_image.scan(reader));
+
+    // errors are reported like read() would
+    TRY(m_image.load_all_but_body());
+
+    init();
+
+    return Result_Ok;
+}
+
+Result Renderer::load() {
+    TRY(m_image.load_all());
+
+    init_body();
+
+    return Result_Ok;
+}
+
+void Renderer::init() {
     m_image.get_cycles(m_cycles);
     m_palette = m_image.palette();
 
-    auto& bmhd = m_image.bmhd();
+    const auto& bmhd = m_image.bmhd();
     auto num_planes = bmhd.num_planes();
     const auto* camg = m_image.camg();
     m_ham = camg && (camg->viewport_mode() & CAMG::HAM) && (num_planes >= 4 && num_planes <= 8);
 
+    m_pixel_format = default_pixel_format(bmhd);
+    m_packed_palette.set_argb(false);
+
+    init_pchg();
+}
+
+void Renderer::init_body() {
     if (!m_image.body() && m_palette) {
         // No image, only a palette: It's a palette file, so draw that palette.
+        auto& bmhd = m_image.bmhd();
         auto& body = m_image.make_body();
 
         const uint16_t margin = 1;
@@ -1290,6 +1940,8 @@ Result Renderer::read(MemoryReader& reader) {
         bmhd.set_page_width(width);
         bmhd.set_page_height(height);
         bmhd.set_trans_color(255);
+        m_pixel_format = default_pixel_format(bmhd);
+        init_pchg();
 
         auto& pixels = body.data();
         pixels.resize((size_t)width * (size_t)height, 255);
@@ -1311,286 +1963,661 @@ Result Renderer::read(MemoryReader& reader) {
         }
     }
 
-    return result;
+    // only then render() uses the cycled palette
+    m_cycles_visible = is_animated() && m_image.bmhd().num_planes() <= 8 &&
+        !m_image.pchg() && !m_image.ctbl() && !m_image.sham();
+
+    // built by the first render_frame() that needs it
+    m_cycle_offsets.clear();
+    m_cycle_pixels.clear();
 }
 
-void Renderer::render(uint8_t* pixels, size_t pitch, double now, bool blend) {
-    const auto& header = m_image.bmhd();
-    const auto width = header.width();
-    const auto height = header.height();
+void Renderer::init_cycle_pixels() {
+    const auto& bmhd = m_image.bmhd();
+
+    std::array<bool, 256> cycled {};
+    for (const auto& cycle : m_cycles) {
+        for (uint_fast16_t index = cycle.low(); index <= cycle.high(); ++ index) {
+            cycled[index] = true;
+        }
+    }
+
+    const size_t width = bmhd.width();
+    const size_t height = bmhd.height();
+    const uint8_t* data = m_image.body()->data().data();
+
+    std::array<uint32_t, 256> counts {};
+    for (size_t index = 0; index < width * height; ++ index) {
+        ++ counts[data[index]];
+    }
+
+    m_cycle_offsets.resize(257);
+    uint32_t offset = 0;
+    for (size_t index = 0; index < 256; ++ index) {
+        m_cycle_offsets[index] = offset;
+        if (cycled[index]) {
+            offset += counts[index];
+        }
+    }
+    m_cycle_offsets[256] = offset;
+    m_cycle_pixels.resize(offset);
+
+    std::array<uint32_t, 256> next;
+    std::copy(m_cycle_offsets.begin(), m_cycle_offsets.end() - 1, next.begin());
+
+    for (size_t y = 0; y < height; ++ y) {
+        const uint8_t* row = data + y * width;
+        for (size_t x = 0; x < width; ++ x) {
+            const uint8_t index = row[x];
+            if (cycled[index]) {
+                m_cycle_pixels[next[index]] = ((uint32_t)y << 16) | (uint32_t)x;
+                ++ next[index];
+            }
+        }
+    }
+}
+
+void Renderer::init_pchg() {
+    m_pchg_rows.clear();
+    m_pchg_regs.clear();
+    m_pchg_colors.clear();
+
+    const auto* pchg = m_image.pchg();
+    if (!pchg) {
+        return;
+    }
+
+    const size_t height = m_image.bmhd().height();
+    const bool argb = m_packed_palette.argb();
+    const auto& changes = pchg->changes();
+    const auto& line_offsets = pchg->line_offsets();
+    const size_t read_lines = pchg->read_lines();
+    const int32_t start_line = pchg->start_line();
+
+    m_pchg_rows.resize(height + 1, 0);
+    m_pchg_regs.reserve(pchg->total_changes());
+    m_pchg_colors.reserve(pchg->total_changes());
+
+    // the i-th changed line is the one of the i-th set bit of the line mask
+    size_t change_index = 0;
+    for (size_t mask_index = 0; mask_index < pchg->line_count() && change_index < read_lines; ++ mask_index) {
+        if (!pchg->line_changed(mask_index)) {
+            continue;
+        }
+
+        const int32_t line = start_line + (int32_t)mask_index;
+        if (line >= (int32_t)height) {
+            break;
+        }
+
+        for (size_t index = line_offsets[change_index]; index < line_offsets[change_index + 1]; ++ index) {
+            const auto& change = changes[index];
+            m_pchg_regs.push_back(change.reg());
+            m_pchg_colors.push_back(PackedPalette::pack(change.color(), argb));
+        }
+        ++ change_index;
+
+        const size_t row = line < 0 ? 0 : (size_t)line;
+        m_pchg_rows[row + 1] = m_pchg_regs.size();
+    }
+
+    // rows without changes end where the previous row ends
+    for (size_t y = 1; y <= height; ++ y) {
+        if (m_pchg_rows[y] < m_pchg_rows[y - 1]) {
+            m_pchg_rows[y] = m_pchg_rows[y - 1];
+        }
+    }
+}
+
+// Writes the alpha values of one row into the 4th byte of each RGBA pixel.
+static void merge_alpha(uint8_t* pixels, const uint8_t* alpha, size_t width) {
+    size_t x = 0;
+
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i rgb_mask = _mm_set1_epi32(0x00FFFFFF);
+
+    for (; x + 16 <= width; x += 16) {
+        const __m128i values = _mm_loadu_si128((const __m128i*)(alpha + x));
+        const __m128i lo = _mm_unpacklo_epi8(zero, values);
+        const __m128i hi = _mm_unpackhi_epi8(zero, values);
+        // alpha ends up in the most significant byte of each 32 bit lane
+        const __m128i alphas[4] = {
+            _mm_unpacklo_epi16(zero, lo),
+            _mm_unpackhi_epi16(zero, lo),
+            _mm_unpacklo_epi16(zero, hi),
+            _mm_unpackhi_epi16(zero, hi),
+        };
+
+        for (size_t index = 0; index < 4; ++ index) {
+            __m128i* out = (__m128i*)(pixels + (x + index * 4) * 4);
+            const __m128i rgb = _mm_and_si128(_mm_loadu_si128(out), rgb_mask);
+            _mm_storeu_si128(out, _mm_or_si128(rgb, alphas[index]));
+        }
+    }
+#endif
+
+    for (; x < width; ++ x) {
+        pixels[x * 4 + 3] = alpha[x];
+    }
+}
+
+PixelFormat Renderer::default_pixel_format(const BMHD& bmhd) {
+    return bmhd.num_planes() == 32 || bmhd.mask() == 1 ? PixelFormat_RGBA8888 : PixelFormat_RGB888;
+}
+
+bool Renderer::supports_pixel_format(const ILBM& image, PixelFormat format) {
+    const auto& bmhd = image.bmhd();
+
+    switch (format) {
+        case PixelFormat_RGB888:
+        case PixelFormat_RGBA8888:
+            return format == default_pixel_format(bmhd);
+
+        case PixelFormat_RGB32:
+        case PixelFormat_ARGB32_Premultiplied:
+            return true;
+
+        case PixelFormat_Indexed8:
+        {
+            const auto num_planes = bmhd.num_planes();
+            const auto* camg = image.camg();
+            const bool ham = camg && (camg->viewport_mode() & CAMG::HAM) && (num_planes >= 4 && num_planes <= 8);
+
+            return num_planes <= 8 && bmhd.mask() != 1 && !ham &&
+                !image.pchg() && !image.ctbl() && !image.sham();
+        }
+        default:
+            return false;
+    }
+}
+
+bool Renderer::set_pixel_format(PixelFormat format) {
+    if (!supports_pixel_format(m_image, format)) {
+        return false;
+    }
+
+    if (format != m_pixel_format) {
+        const bool argb = format == PixelFormat_RGB32 || format == PixelFormat_ARGB32_Premultiplied || format == PixelFormat_Indexed8;
+        m_pixel_format = format;
+        m_frame_valid = false;
+
+        if (argb != m_packed_palette.argb()) {
+            m_packed_palette.set_argb(argb);
+            init_pchg();
+        }
+    }
+
+    return true;
+}
+
+// Zeroes ARGB32_Premultiplied pixels that are masked out. Mask alpha is only
+// ever 0 or 255, so the others are already right.
+static void merge_alpha_premultiplied(uint8_t* pixels, const uint8_t* alpha, size_t width) {
+    for (size_t x = 0; x < width; ++ x) {
+        if (alpha[x] == 0) {
+            std::memset(pixels + x * 4, 0, 4);
+        }
+    }
+}
+
+// RGB888 to native 0xFFRRGGBB words.
+static void rgb_to_argb(const uint8_t* rgb, uint8_t* pixels, size_t width) {
+    for (size_t x = 0; x < width; ++ x) {
+        const uint8_t* in = rgb + x * 3;
+        const uint32_t value = 0xFF000000 | ((uint32_t)in[0] << 16) | ((uint32_t)in[1] << 8) | (uint32_t)in[2];
+        std::memcpy(pixels + x * 4, &value, 4);
+    }
+}
 
+// RGBA8888 to native 0xAARRGGBB words. If given the mask replaces the alpha
+// channel. RGB32 has no alpha, so there it's always 255.
+static void rgba_to_argb(const uint8_t* rgba, const uint8_t* alpha, uint8_t* pixels, size_t width, PixelFormat format) {
+    for (size_t x = 0; x < width; ++ x) {
+        const uint8_t* in = rgba + x * 4;
+        uint32_t r = in[0];
+        uint32_t g = in[1];
+        uint32_t b = in[2];
+        uint32_t a = alpha ? alpha[x] : in[3];
+
+        if (format == PixelFormat_RGB32) {
+            a = 255;
+        } else if (a != 255) {
+            r = (r * a + 127) / 255;
+            g = (g * a + 127) / 255;
+            b = (b * a + 127) / 255;
+        }
+
+        const uint32_t value = (a << 24) | (r << 16) | (g << 8) | b;
+        std::memcpy(pixels + x * 4, &value, 4);
+    }
+}
+
+void Renderer::prepare_render(double now, bool blend) {
+    const auto& header = m_image.bmhd();
     const auto num_planes = header.num_planes();
 
-    const auto* body = m_image.body();
-    const auto& data = body->data();
-    const auto& mask = body->mask();
-    const bool is_masked = header.mask() == 1;
+    if (num_planes == 24 || num_planes == 32) {
+        return;
+    }
 
-    const uint8_t* ilbm_pixels = data.data();
     const auto* ctbl = m_image.ctbl();
     const auto* sham = m_image.sham();
     const auto* pchg = m_image.pchg();
 
-    if (num_planes == 24) {
-        if (is_masked) {
-            size_t out_line_index = 0;
-            size_t ilbm_index = 0;
-            for (auto y = 0; y < height; ++ y) {
-                size_t out_index = out_line_index;
-                for (auto x = 0; x < width; ++ x) {
-                    std::memcpy(pixels + out_index, ilbm_pixels + ilbm_index, 3);
-                    ilbm_index += 3;
-                    out_index += 4;
-                }
-                out_line_index += pitch;
-            }
-        } else {
-            size_t ilbm_index = 0;
-            size_t out_index = 0;
-            size_t ilbm_line_len = (size_t)width * 3;
-            for (auto y = 0; y < height; ++ y) {
-                std::memcpy(pixels + out_index, ilbm_pixels + ilbm_index, ilbm_line_len);
-                out_index += pitch;
-                ilbm_index += ilbm_line_len;
-            }
-        }
-    } else if (num_planes == 32) {
-        size_t ilbm_index = 0;
-        size_t out_index = 0;
-        size_t ilbm_line_len = (size_t)width * 4;
-        for (auto y = 0; y < height; ++ y) {
-            std::memcpy(pixels + out_index, ilbm_pixels + ilbm_index, ilbm_line_len);
-            out_index += pitch;
-            ilbm_index += ilbm_line_len;
-        }
-    } else if (pchg) {
+    if (pchg) {
+        // render_rows() applies the changes of each row to this
         if (m_palette) {
             m_cycled_palette = *m_palette;
         }
 
-        size_t pixel_len = 3 + is_masked;
-        const auto& line_mask = pchg->line_mask();
-        const auto& changes = pchg->changes();
-        int16_t start_line = pchg->start_line();
-
-        size_t out_line_index = 0;
-        size_t ilbm_index = 0;
+        m_packed_palette.assign(m_cycled_palette);
+    } else if (m_palette || ctbl || sham) {
+        if (m_palette) {
+            m_cycled_palette.apply_cycles_from(*m_palette, m_cycles, now, blend);
+        }
 
-        // XXX: there is a bug somewhere
-        size_t change_index = 0;
-        for (int32_t line_index = start_line; line_index < 0; ++ line_index) {
-            int32_t mask_index = line_index - start_line;
+        if (!m_ham && !ctbl && !sham) {
+            m_packed_palette.assign(m_cycled_palette);
+        }
+    } else {
+        // XXX: No idea if colors here should be done like in HAM? Need example files.
+        // const uint8_t color_shift = 8 - num_planes;
+        // const uint8_t color_mask = (1 << color_shift) - 1;
 
-            if (mask_index >= 0 && (size_t)mask_index < line_mask.size() && line_mask[mask_index]) {
-                for (const auto& change : changes[change_index]) {
-                    m_cycled_palette[change.reg()] = change.color();
-                }
-                ++ change_index;
-            }
+        // grayscale, 8 planes are used as is
+        const uint8_t *lookup_table = num_planes < 8 ? COLOR_LOOKUP_TABLES[num_planes] : nullptr;
+        const uint8_t index_mask = num_planes < 8 ? (1 << num_planes) - 1 : 0xFF;
+        for (uint_fast16_t index = 0; index < 256; ++ index) {
+            const uint8_t value = lookup_table ? lookup_table[index & index_mask] : (uint8_t)index;
+            m_packed_palette.set(index, Color(value, value, value));
         }
+    }
+}
+
+void Renderer::render_rows(size_t begin, size_t end, const uint8_t* data, const uint8_t* alpha, uint8_t* pixels, size_t pitch) {
+    const auto& header = m_image.bmhd();
+    const size_t width = header.width();
+    const auto num_planes = header.num_planes();
+    const bool is_masked = header.mask() == 1;
 
-        for (uint16_t y = 0; y < height; ++ y) {
-            size_t out_index = out_line_index;
+    const auto* ctbl = m_image.ctbl();
+    const auto* sham = m_image.sham();
+    const bool pchg = !m_pchg_rows.empty();
 
-            int32_t mask_index = (int32_t)y - start_line + 1;
+    const size_t ilbm_pixel_len = (num_planes + 7) / 8;
+    const size_t ilbm_line_len = width * ilbm_pixel_len;
 
-            if (mask_index >= 0 && (size_t)mask_index < line_mask.size() && line_mask[mask_index]) {
-                for (const auto& change : changes[change_index]) {
-                    m_cycled_palette[change.reg()] = change.color();
-                }
-                ++ change_index;
-            }
+    const PixelFormat format = m_pixel_format;
+    const bool argb = format == PixelFormat_RGB32 || format == PixelFormat_ARGB32_Premultiplied;
+    const size_t pixel_len =
+        format == PixelFormat_Indexed8 ? 1 :
+        format == PixelFormat_RGB888 ? 3 : 4;
 
-            for (uint16_t x = 0; x < width; ++ x) {
-                auto color = m_cycled_palette[data[ilbm_index]];
+    // `data` starts with row `begin`
+    auto ilbm_line = [&](size_t y) {
+        return data + (y - begin) * ilbm_line_len;
+    };
 
-                pixels[out_index] = color.r();
-                pixels[out_index + 1] = color.g();
-                pixels[out_index + 2] = color.b();
+    auto alpha_line = [&](size_t y) {
+        return alpha + (y - begin) * width;
+    };
 
-                ++ ilbm_index;
-                out_index += pixel_len;
+    if (num_planes == 24) {
+        if (argb) {
+            for (size_t y = begin; y < end; ++ y) {
+                rgb_to_argb(ilbm_line(y), pixels + y * pitch, width);
+            }
+        } else if (pixel_len == 4) {
+            for (size_t y = begin; y < end; ++ y) {
+                const uint8_t* line = ilbm_line(y);
+                uint8_t* out_line = pixels + y * pitch;
+                for (size_t x = 0; x < width; ++ x) {
+                    std::memcpy(out_line + x * 4, line + x * 3, 3);
+                }
+            }
+        } else {
+            for (size_t y = begin; y < end; ++ y) {
+                std::memcpy(pixels + y * pitch, ilbm_line(y), ilbm_line_len);
             }
-            out_line_index += pitch;
         }
-    } else if (m_palette || ctbl || sham) {
-        if (m_palette) {
-            m_cycled_palette.apply_cycles_from(*m_palette, m_cycles, now, blend);
+    } else if (num_planes == 32) {
+        if (argb) {
+            for (size_t y = begin; y < end; ++ y) {
+                rgba_to_argb(ilbm_line(y), is_masked ? alpha_line(y) : nullptr, pixels + y * pitch, width, format);
+            }
+            // alpha is already done
+            return;
         }
-        size_t notlaced = 1;
+
+        for (size_t y = begin; y < end; ++ y) {
+            std::memcpy(pixels + y * pitch, ilbm_line(y), ilbm_line_len);
+        }
+    } else if (format == PixelFormat_Indexed8) {
+        // colors are in color_table()
+        for (size_t y = begin; y < end; ++ y) {
+            std::memcpy(pixels + y * pitch, ilbm_line(y), width);
+        }
+    } else if (!pchg && ((m_ham && m_palette) || ctbl || sham)) {
+        bool laced = false;
 
         // XXX: are SHAM/CTBL palettes cycled?
-        const std::vector<Palette> *palettes = nullptr;
+        const std::vector<Palette16> *palettes = nullptr;
         if (ctbl) {
             palettes = &ctbl->palettes();
         } else if (sham) {
             const auto* camg = m_image.camg();
             auto viewport_mode = camg ? camg->viewport_mode() : 0;
-            bool laced = viewport_mode & CAMG::LACE;
-            notlaced = !laced;
+            laced = viewport_mode & CAMG::LACE;
             palettes = &sham->palettes();
         }
 
-        size_t pixel_len = 3 + is_masked;
-        size_t palette_index = 0;
-
-        const Palette *palette = &m_cycled_palette;
+        // CTBL/SHAM only replace colors 0 to 15 of the CMAP palette, which
+        // is shared by all rows
+        Palette row;
+        if (!palettes) {
+            row = m_cycled_palette;
+        } else if (m_palette) {
+            row = *m_palette;
+        }
 
-        // TODO: Does HAM without palettes exist? Is then the palette to be assumed all black?
-        if (m_ham) {
-            // HAM decoding http://www.etwright.org/lwsdk/docs/filefmts/ilbm.html
-            const uint8_t payload_bits = num_planes - 2;
-            const uint8_t ham_shift = 8 - payload_bits;
-            const uint8_t ham_mask = (1 << ham_shift) - 1;
-            const uint8_t payload_mask = 0xFF >> ham_shift;
-            //const uint8_t *lookup_table = COLOR_LOOKUP_TABLES[payload_bits];
-
-            size_t ilbm_index = 0;
-            size_t out_line_index = 0;
-
-            // TODO: different numbers of num_planes are encoded differently?
-            // See: https://en.wikipedia.org/wiki/Hold-And-Modify
-            for (uint16_t y = 0; y < height; ++ y) {
-                size_t out_index = out_line_index;
-                uint8_t r = 0;
-                uint8_t g = 0;
-                uint8_t b = 0;
-
-                if (palettes) {
-                    // XXX: do SHAM palettes need to be cycled?
-                    palette = &(*palettes)[palette_index];
-                    palette_index += notlaced | (y & 1);
+        // laced SHAM images share one palette between two rows, rows past the
+        // end use CMAP
+        auto row_colors = [&](size_t y) -> const Palette16* {
+            if (palettes) {
+                const size_t index = laced ? y / 2 : y;
+                if (index < palettes->size()) {
+                    return &(*palettes)[index];
                 }
+            }
+            return nullptr;
+        };
 
-                for (uint16_t x = 0; x < width; ++ x) {
-                    uint8_t code = data[ilbm_index];
-                    uint8_t mode = code >> payload_bits;
-                    uint8_t color_index = code & payload_mask;
-
-                    switch (mode) {
-                        case 0:
-                        {
-                            auto color = (*palette)[color_index];
-                            r = color.r();
-                            g = color.g();
-                            b = color.b();
-                            break;
-                        }
-                        case 1:
-                        {
-                            // blue
-                            b = (color_index << ham_shift) | (b & ham_mask);
-                            break;
-                        }
-                        case 2:
-                        {
-                            // red
-                            r = (color_index << ham_shift) | (r & ham_mask);
-                            break;
-                        }
-                        case 3:
-                        {
-                            // green
-                            g = (color_index << ham_shift) | (g & ham_mask);
-                            break;
-                        }
-                        default:
-                            // not possible
-                            break;
-                    }
+        // Sets colors 0 to 15 of `row` for row `y`. False if they're the same
+        // as for the previous row.
+        const Palette16 *current_colors = nullptr;
+        bool first_row = true;
+        auto set_row_colors = [&](size_t y) {
+            const Palette16 *colors = row_colors(y);
+            if (!first_row && colors == current_colors) {
+                return false;
+            }
+            first_row = false;
+            current_colors = colors;
 
-                    pixels[out_index] = r;
-                    pixels[out_index + 1] = g;
-                    pixels[out_index + 2] = b;
+            if (colors) {
+                for (uint_fast8_t index = 0; index < 16; ++ index) {
+                    row[index] = (*colors)[index].color();
+                }
+            } else if (palettes) {
+                for (uint_fast8_t index = 0; index < 16; ++ index) {
+                    row[index] = m_palette ? (*m_palette)[index] : Color();
+                }
+            }
+            return true;
+        };
 
-                    out_index += pixel_len;
-                    ++ ilbm_index;
+        // TODO: Does HAM without palettes exist? Is then the palette to be assumed all black?
+        if (m_ham) {
+            HAMDecoder decoder { num_planes, pixel_len, argb };
+
+            for (size_t y = begin; y < end; ++ y) {
+                // XXX: do SHAM palettes need to be cycled?
+                if (set_row_colors(y)) {
+                    decoder.set_palette(row);
                 }
-                out_line_index += pitch;
+
+                decoder.decode_row(ilbm_line(y), width, pixels + y * pitch);
             }
-        } else {
+        } else if (palettes) {
             // TODO: Is CTBL/SHAM to be used if HAM flag isn't set?
-            size_t out_line_index = 0;
-            size_t ilbm_index = 0;
+            PackedPalette packed;
+            packed.set_argb(argb);
+            packed.assign(row);
+
+            for (size_t y = begin; y < end; ++ y) {
+                // XXX: do SHAM palettes need to be cycled?
+                if (set_row_colors(y)) {
+                    for (uint_fast8_t index = 0; index < 16; ++ index) {
+                        packed.set(index, row[index]);
+                    }
+                }
 
-            for (uint16_t y = 0; y < height; ++ y) {
-                size_t out_index = out_line_index;
+                expand_indexed(ilbm_line(y), packed.data(), width, pixel_len, pixels + y * pitch);
+            }
+        }
+    } else {
+        // One palette for all rows (cycled, grayscale or plain), patched with
+        // the changes of each row for PCHG.
+        const uint32_t* lut = m_packed_palette.data();
+        std::array<uint32_t, 256> row_lut;
+
+        if (pchg) {
+            // all changes of the rows above `begin` are already in effect
+            std::memcpy(row_lut.data(), lut, sizeof(row_lut));
+            for (size_t index = m_pchg_rows[0]; index < m_pchg_rows[begin]; ++ index) {
+                row_lut[m_pchg_regs[index]] = m_pchg_colors[index];
+            }
+            lut = row_lut.data();
+        }
 
-                if (palettes) {
-                    // XXX: do SHAM palettes need to be cycled?
-                    palette = &(*palettes)[palette_index];
-                    palette_index += notlaced | (y & 1);
+        for (size_t y = begin; y < end; ++ y) {
+            if (pchg) {
+                for (size_t index = m_pchg_rows[y]; index < m_pchg_rows[y + 1]; ++ index) {
+                    row_lut[m_pchg_regs[index]] = m_pchg_colors[index];
                 }
+            }
 
-                for (uint16_t x = 0; x < width; ++ x) {
-                    auto color = (*palette)[data[ilbm_index]];
-    
-                    pixels[out_index] = color.r();
-                    pixels[out_index + 1] = color.g();
-                    pixels[out_index + 2] = color.b();
+            expand_indexed(ilbm_line(y), lut, width, pixel_len, pixels + y * pitch);
+        }
+    }
 
-                    ++ ilbm_index;
-                    out_index += pixel_len;
-                }
-                out_line_index += pitch;
+    if (is_masked) {
+        if (format == PixelFormat_RGBA8888) {
+            for (size_t y = begin; y < end; ++ y) {
+                merge_alpha(pixels + y * pitch, alpha_line(y), width);
+            }
+        } else if (format == PixelFormat_ARGB32_Premultiplied) {
+            for (size_t y = begin; y < end; ++ y) {
+                merge_alpha_premultiplied(pixels + y * pitch, alpha_line(y), width);
             }
         }
-    } else if (num_planes < 8) {
-        // XXX: No idea if colors here should be done like in HAM? Need example files.
-        // const uint8_t color_shift = 8 - num_planes;
-        // const uint8_t color_mask = (1 << color_shift) - 1;
+    }
+}
 
-        const uint8_t *lookup_table = COLOR_LOOKUP_TABLES[num_planes];
-        size_t pixel_len = 3 + is_masked;
+void Renderer::render(uint8_t* pixels, size_t pitch, double now, bool blend) {
+    const auto& header = m_image.bmhd();
+    const size_t width = header.width();
+    const size_t height = header.height();
+    const auto num_planes = header.num_planes();
+    const bool is_masked = header.mask() == 1;
 
-        size_t out_line_index = 0;
-        size_t ilbm_index = 0;
+    const auto* body = m_image.body();
+    const auto& data = body->data();
+    const auto& mask = body->mask();
+    const size_t ilbm_line_len = width * ((num_planes + 7) / 8);
 
-        for (auto y = 0; y < height; ++ y) {
-            size_t out_index = out_line_index;
-            for (auto x = 0; x < width; ++ x) {
-                uint8_t value = lookup_table[data[ilbm_index]];
-                std::memset(pixels + out_index, value, 3);
+    prepare_render(now, blend);
 
-                out_index += pixel_len;
-                ++ ilbm_index;
-            }
-            out_line_index += pitch;
-        }
+    // Rows are independent, PCHG bands start with the changes of the rows
+    // above them. So big images are rendered in bands of rows on the thread
+    // pool, including their alpha.
+    const size_t out_pixel_len =
+        m_pixel_format == PixelFormat_Indexed8 ? 1 :
+        m_pixel_format == PixelFormat_RGB888 ? 3 : 4;
+    const bool parallel = width * height * out_pixel_len >= PARALLEL_MIN_BYTES && thread_count() > 1;
+
+    auto render_band = [&](size_t begin, size_t end) {
+        render_rows(begin, end, data.data() + begin * ilbm_line_len, is_masked ? mask.data() + begin * width : nullptr, pixels, pitch);
+    };
+
+    if (parallel) {
+        parallel_for(height, render_band);
     } else {
-        size_t ilbm_pixel_len = (num_planes + 7) / 8;
-        size_t out_pixel_len = 3 + is_masked;
+        render_band(0, height);
+    }
+}
+
+Result Renderer::render_body(uint8_t* pixels, size_t pitch) {
+    prepare_render(0.0, false);
+
+    Result result = m_image.decode_body([&](size_t begin, size_t end, const uint8_t* data, const uint8_t* alpha) {
+        render_rows(begin, end, data, alpha, pixels, pitch);
+    });
+
+    // the decoded BODY isn't kept, that's the point
+    m_image.clear_body();
+    const Result loaded = m_image.load_all();
+
+    TRY(result);
+
+    return loaded;
+}
+
+bool Renderer::update_frame(double now, bool blend) {
+    m_frame_now = now;
+    m_frame_blend = blend;
+    m_next_cache_index = SIZE_MAX;
+    m_changed_indices.clear();
+
+    if (!m_frame_valid) {
+        return true;
+    }
+
+    if (!m_cycles_visible) {
+        return false;
+    }
+
+    m_cycled_palette.apply_cycles_from(*m_palette, m_cycles, now, blend);
+    m_cycled_palette.diff(m_frame_palette, m_changed_indices);
+
+    return !m_changed_indices.empty();
+}
+
+bool Renderer::cache_palettes(uint32_t fps, size_t frame_count, bool blend, size_t max_palettes) {
+    m_cached_palettes.clear();
+    m_frame_palette_indices.clear();
+    m_frame_cache_index = SIZE_MAX;
+
+    if (!is_animated() || fps == 0 || frame_count == 0) {
+        return false;
+    }
 
-        size_t ilbm_index = 0;
-        size_t out_line_index = 0;
+    m_frame_palette_indices.reserve(frame_count);
 
-        for (auto y = 0; y < height; ++ y) {
-            size_t out_index = out_line_index;
-            for (auto x = 0; x < width; ++ x) {
-                uint8_t value = data[ilbm_index];
-                std::memset(pixels + out_index, value, 3);
+    Palette palette;
+    for (size_t frame = 0; frame < frame_count; ++ frame) {
+        palette.apply_cycles_from(*m_palette, m_cycles, (double)frame / (double)fps, blend);
 
-                out_index += out_pixel_len;
-                ilbm_index += ilbm_pixel_len;
+        // slow cycles stay on the same step for many frames
+        if (m_cached_palettes.empty() || !(m_cached_palettes.back() == palette)) {
+            if (m_cached_palettes.size() >= max_palettes) {
+                LOG_DEBUG("too many distinct palettes for the palette cache: > %zu", max_palettes);
+                m_cached_palettes.clear();
+                m_frame_palette_indices.clear();
+                return false;
             }
-            out_line_index += pitch;
+            m_cached_palettes.push_back(palette);
         }
+        m_frame_palette_indices.push_back(m_cached_palettes.size() - 1);
     }
 
-    if (is_masked) {
-        size_t out_line_index = 0;
-        size_t mask_index = 0;
-
-        for (auto y = 0; y < height; ++ y) {
-            size_t out_index = out_line_index;
-            for (auto x = 0; x < width; ++ x) {
-                pixels[out_index + 3] = mask[mask_index] * 255;
-                out_index += 4;
-                ++ mask_index;
+    m_cache_fps = fps;
+    m_cache_blend = blend;
+
+    return true;
+}
+
+bool Renderer::update_cached_frame(size_t frame) {
+    assert(has_palette_cache());
+
+    frame %= m_frame_palette_indices.size();
+    const size_t index = m_frame_palette_indices[frame];
+
+    m_frame_now = (double)frame / (double)m_cache_fps;
+    m_frame_blend = m_cache_blend;
+    m_next_cache_index = index;
+    m_changed_indices.clear();
+
+    if (!m_frame_valid) {
+        return true;
+    }
+
+    if (!m_cycles_visible || index == m_frame_cache_index) {
+        return false;
+    }
+
+    m_cycled_palette = m_cached_palettes[index];
+    m_cycled_palette.diff(m_frame_palette, m_changed_indices);
+
+    return !m_changed_indices.empty();
+}
+
+void Renderer::render_frame(uint8_t* pixels, size_t pitch) {
+    m_frame_cache_index = m_next_cache_index;
+
+    // the pixels of HAM images depend on their neighbours
+    const bool incremental = m_cycles_visible && !m_ham;
+
+    if (!m_frame_valid || !incremental) {
+        render(pixels, pitch, m_frame_now, m_frame_blend);
+        m_frame_palette = m_cycled_palette;
+        m_frame_valid = true;
+
+        // Indexed8 frames only change the color table, so its pixels aren't
+        // looked up by index.
+        if (incremental && m_pixel_format != PixelFormat_Indexed8 && m_cycle_offsets.empty()) {
+            init_cycle_pixels();
+        }
+        return;
+    }
+
+    if (m_pixel_format == PixelFormat_Indexed8) {
+        // the pixels are palette indices, only the colors change
+        for (uint8_t index : m_changed_indices) {
+            m_packed_palette.set(index, m_cycled_palette[index]);
+        }
+    } else if (m_pixel_format == PixelFormat_RGB32 || m_pixel_format == PixelFormat_ARGB32_Premultiplied) {
+        for (uint8_t index : m_changed_indices) {
+            const uint32_t begin = m_cycle_offsets[index];
+            const uint32_t end = m_cycle_offsets[index + 1];
+            const auto& color = m_cycled_palette[index];
+            const uint32_t rgb = ((uint32_t)color.r() << 16) | ((uint32_t)color.g() << 8) | (uint32_t)color.b();
+
+            for (uint32_t pixel_index = begin; pixel_index < end; ++ pixel_index) {
+                const uint32_t pos = m_cycle_pixels[pixel_index];
+                const size_t y = pos >> 16;
+                const size_t x = pos & 0xFFFF;
+                uint8_t* pixel = pixels + y * pitch + x * 4;
+
+                // alpha of masked images doesn't change, premultiplied masked
+                // out pixels stay all zero
+                uint32_t value;
+                std::memcpy(&value, pixel, 4);
+                value = value & 0xFF000000 ? (value & 0xFF000000) | rgb : 0;
+                std::memcpy(pixel, &value, 4);
+            }
+        }
+    } else {
+        // only RGB is written, alpha of masked images doesn't change
+        const size_t pixel_len = m_pixel_format == PixelFormat_RGBA8888 ? 4 : 3;
+
+        for (uint8_t index : m_changed_indices) {
+            const uint32_t begin = m_cycle_offsets[index];
+            const uint32_t end = m_cycle_offsets[index + 1];
+            const auto& color = m_cycled_palette[index];
+            const uint8_t rgb[3] = { color.r(), color.g(), color.b() };
+
+            for (uint32_t pixel_index = begin; pixel_index < end; ++ pixel_index) {
+                const uint32_t pos = m_cycle_pixels[pixel_index];
+                const size_t y = pos >> 16;
+                const size_t x = pos & 0xFFFF;
+                std::memcpy(pixels + y * pitch + x * pixel_len, rgb, sizeof(rgb));
             }
-            out_line_index += pitch;
         }
     }
+
+    m_frame_palette = m_cycled_palette;
 }
 
 Result TextChunk::read(MemoryReader& reader) {
@@ -3,14 +3,17 @@
 #pragma once
 
 #include <optional>
+#include <array>
 #include <vector>
 #include <memory>
+#include <functional>
 #include <stdint.h>
 #include <cmath>
 #include <cstdio>
 #include <string>
 
 #include "MemoryReader.h"
+#include "StreamReader.h"
 #include "Color.h"
 #include "Palette.h"
 
@@ -103,21 +106,39 @@ public:
 class BODY {
 private:
     std::vector<uint8_t> m_data;
-    std::vector<bool> m_mask;
+    // alpha plane, 0 or 255 per pixel
+    std::vector<uint8_t> m_mask;
 
 public:
     BODY() : m_data{}, m_mask{} {}
 
     inline const std::vector<uint8_t>& data() const { return m_data; }
-    inline const std::vector<bool>& mask() const { return m_mask; }
+    inline const std::vector<uint8_t>& mask() const { return m_mask; }
 
     inline std::vector<uint8_t>& data() { return m_data; }
-    inline std::vector<bool>& mask() { return m_mask; }
+    inline std::vector<uint8_t>& mask() { return m_mask; }
+
+    // Rows [begin, end) of pixels and alpha (nullptr without a mask), laid
+    // out like data() and mask() but starting with row `begin`.
+    typedef std::function<void(size_t begin, size_t end, const uint8_t* pixels, const uint8_t* alpha)> Rows;
 
     Result read(MemoryReader& reader, FileType file_type, const BMHD& bmhd);
 
+    // Decodes row by row, `reader` is limited to the BODY chunk.
+    Result read(BufferedReader& reader, FileType file_type, const BMHD& bmhd);
+
+    // Decodes like read(), but instead of keeping the pixels passes them to
+    // `rows` a few rows at a time. Ranges of rows of big images are passed
+    // from the thread pool in parallel, within a range rows come in order.
+    static Result decode(MemoryReader& reader, FileType file_type, const BMHD& bmhd, const Rows& rows);
+
 protected:
-    void decode_line(const std::vector<uint8_t>& line, uint8_t mask, uint16_t width, size_t plane_len, size_t num_planes, FileType file_type);
+    static Result check(FileType file_type, const BMHD& bmhd);
+    Result init(FileType file_type, const BMHD& bmhd);
+    // `Reader` is MemoryReader or BufferedReader.
+    template<typename Reader>
+    static Result decode_rows(Reader& reader, FileType file_type, const BMHD& bmhd, uint8_t* pixels, uint8_t* alpha, const Rows* rows);
+    static void decode_line(const uint8_t* line, uint8_t* pixels, uint8_t* alpha, uint16_t width, size_t plane_len, size_t num_planes, FileType file_type);
 };
 
 class CMAP {
@@ -236,31 +257,54 @@ public:
 
 class CTBL {
 private:
-    std::vector<Palette> m_palettes;
+    size_t m_palette_count;
+
+    // Colors 0 to 15 of each row. The other colors, and all colors of rows
+    // past the end, are those of CMAP.
+    std::vector<Palette16> m_palettes;
 
 public:
-    CTBL() : m_palettes{} {}
+    static const size_t HEADER_SIZE = 0;
 
-    inline const std::vector<Palette>& palettes() const { return m_palettes; }
-    inline std::vector<Palette>& palettes() { return m_palettes; }
+    CTBL() : m_palette_count(0), m_palettes{} {}
+
+    // number of palettes in the chunk, also known after read_header()
+    inline size_t palette_count() const { return m_palette_count; }
+
+    inline const std::vector<Palette16>& palettes() const { return m_palettes; }
+    inline std::vector<Palette16>& palettes() { return m_palettes; }
 
     Result read(MemoryReader& reader);
+
+    // `reader` only needs to hold the first HEADER_SIZE bytes of the chunk.
+    Result read_header(MemoryReader& reader, size_t chunk_len);
 };
 
 class SHAM {
 private:
     uint16_t m_version;
-    std::vector<Palette> m_palettes;
+    size_t m_palette_count;
+
+    // Like CTBL, but laced images have one for every two rows.
+    std::vector<Palette16> m_palettes;
 
 public:
-    SHAM() : m_version(0), m_palettes{} {}
+    static const size_t HEADER_SIZE = 2;
+
+    SHAM() : m_version(0), m_palette_count(0), m_palettes{} {}
 
     inline uint16_t version() const { return m_version; }
 
-    inline const std::vector<Palette>& palettes() const { return m_palettes; }
-    inline std::vector<Palette>& palettes() { return m_palettes; }
+    // number of palettes in the chunk, also known after read_header()
+    inline size_t palette_count() const { return m_palette_count; }
+
+    inline const std::vector<Palette16>& palettes() const { return m_palettes; }
+    inline std::vector<Palette16>& palettes() { return m_palettes; }
 
     Result read(MemoryReader& reader);
+
+    // `reader` only needs to hold the first HEADER_SIZE bytes of the chunk.
+    Result read_header(MemoryReader& reader, size_t chunk_len);
 };
 
 class PCHG {
@@ -299,8 +343,14 @@ private:
     uint16_t m_max_changes; // max number of changes on a single line
     uint32_t m_total_changes;
 
-    std::vector<bool> m_line_mask;
-    std::vector<std::vector<ColorChange>> m_changes;
+    // One bit per line from start_line() on, the most significant bit of the
+    // first word is the first line, like in the file.
+    std::vector<uint32_t> m_line_mask;
+
+    // Changes of all changed lines in one array. Those of the i-th changed
+    // line are [m_line_offsets[i], m_line_offsets[i + 1]).
+    std::vector<ColorChange> m_changes;
+    std::vector<uint32_t> m_line_offsets;
 
 public:
     enum {
@@ -314,6 +364,8 @@ public:
         FLAG_USE_ALPHA = 1 << 2,
     };
 
+    static const size_t HEADER_SIZE = 20;
+
     PCHG() :
         m_compression(0),
         m_flags(0),
@@ -325,7 +377,8 @@ public:
         m_max_changes(0),
         m_total_changes(0),
         m_line_mask{},
-        m_changes{}
+        m_changes{},
+        m_line_offsets{}
     {}
 
     inline uint16_t compression() const { return m_compression; }
@@ -337,12 +390,24 @@ public:
     inline uint16_t max_reg() const { return m_max_reg; }
     inline uint16_t max_changes() const { return m_max_changes; }
     inline uint32_t total_changes() const { return m_total_changes; }
-    inline const std::vector<bool>& line_mask() const { return m_line_mask; }
-    inline const std::vector<std::vector<ColorChange>>& changes() const { return m_changes; }
+    inline const std::vector<uint32_t>& line_mask() const { return m_line_mask; }
+    inline const std::vector<ColorChange>& changes() const { return m_changes; }
+    inline const std::vector<uint32_t>& line_offsets() const { return m_line_offsets; }
+
+    // If line start_line() + line_index has changes. Padding bits are clear.
+    inline bool line_changed(size_t line_index) const {
+        return line_index / 32 < m_line_mask.size() && (m_line_mask[line_index / 32] & ((uint32_t)1 << (31 - line_index % 32))) != 0;
+    }
+
+    // Number of changed lines that were read, their changes are in changes().
+    inline size_t read_lines() const { return m_line_offsets.empty() ? 0 : m_line_offsets.size() - 1; }
 
     Result read(MemoryReader& reader);
     Result read_line_data(MemoryReader& reader);
 
+    // Only the header fields, no line mask or changes.
+    Result read_header(MemoryReader& reader, size_t chunk_len);
+
     void print(std::FILE* file) const;
 };
 
@@ -358,6 +423,9 @@ public:
     inline TextChunk(const TextChunk&) = default;
     inline TextChunk(TextChunk&&) = default;
 
+    inline TextChunk& operator=(const TextChunk&) = default;
+    inline TextChunk& operator=(TextChunk&&) = default;
+
     inline const std::string& content() const { return m_content; }
     inline std::string& content() { return m_content; }
 
@@ -385,8 +453,35 @@ class NAME : public TextChunk {};
 class AUTH : public TextChunk {};
 class Copy : public TextChunk {};
 
+// Position of a chunk inside the data that was passed to ILBM::scan(). The
+// offset points past the chunk header and the length is cut off at the end
+// of the FORM.
+struct ChunkInfo {
+    std::array<char, 4> fourcc;
+    size_t offset;
+    size_t length;
+};
+
 class ILBM {
 private:
+    // Chunks that scan() leaves for later. BMHD and CAMG are always parsed
+    // right away, everything else needs one or both of them.
+    enum LazyChunk : uint32_t {
+        LazyChunk_NAME = 1 << 0,
+        LazyChunk_AUTH = 1 << 1,
+        LazyChunk_ANNO = 1 << 2,
+        LazyChunk_Copy = 1 << 3,
+        LazyChunk_DYCP = 1 << 4,
+        LazyChunk_BODY = 1 << 5,
+        LazyChunk_CMAP = 1 << 6,
+        LazyChunk_CTBL = 1 << 7,
+        LazyChunk_SHAM = 1 << 8,
+        LazyChunk_PCHG = 1 << 9,
+        LazyChunk_CRNG = 1 << 10,
+        LazyChunk_CCRT = 1 << 11,
+        LazyChunk_All  = (1 << 12) - 1,
+    };
+
     FileType m_file_type;
     BMHD m_bmhd;
     std::optional<NAME> m_name;
@@ -402,6 +497,31 @@ private:
     std::unique_ptr<PCHG> m_pchg;
     std::vector<CRNG> m_crngs;
     std::vector<CCRT> m_ccrts;
+    std::vector<ChunkInfo> m_chunks;
+    const uint8_t* m_source;
+    uint32_t m_pending;
+    Result m_lazy_result;
+
+    void reset();
+    // `Reader` is MemoryReader or StreamReader.
+    template<typename Reader>
+    Result read_form_header(Reader& reader, uint32_t& main_chunk_len);
+    template<typename Reader>
+    Result read_chunks(Reader& reader, size_t main_remaining, bool only_metadata);
+    Result read_chunk(const std::array<char, 4>& fourcc, MemoryReader& chunk_reader, bool only_metadata);
+    Result read_chunk_header(const std::array<char, 4>& fourcc, MemoryReader& chunk_reader, size_t chunk_len);
+    void finish_cmap();
+    void load_pending(uint32_t chunks);
+
+    static uint32_t lazy_chunk_flag(const std::array<char, 4>& fourcc);
+
+    // Parsing a pending chunk doesn't change what the object represents, so
+    // the accessors stay const.
+    inline void load(uint32_t chunks) const {
+        if (m_pending & chunks) {
+            const_cast<ILBM*>(this)->load_pending(m_pending & chunks);
+        }
+    }
 
 public:
     static const uint32_t MIN_SIZE = BMHD::SIZE + 12;
@@ -421,63 +541,96 @@ public:
         m_sham{},
         m_pchg{},
         m_crngs{},
-        m_ccrts{} {}
+        m_ccrts{},
+        m_chunks{},
+        m_source{nullptr},
+        m_pending{0},
+        m_lazy_result{Result_Ok} {}
 
     inline FileType file_type() const { return m_file_type; }
     inline const BMHD& bmhd() const { return m_bmhd; }
-    inline const NAME* name() const { return m_name ? &*m_name : nullptr; }
-    inline const AUTH* auth() const { return m_auth ? &*m_auth : nullptr; }
-    inline const ANNO* anno() const { return m_anno ? &*m_anno : nullptr; }
-    inline const Copy* copy() const { return m_copy ? &*m_copy : nullptr; }
+    inline const NAME* name() const { load(LazyChunk_NAME); return m_name ? &*m_name : nullptr; }
+    inline const AUTH* auth() const { load(LazyChunk_AUTH); return m_auth ? &*m_auth : nullptr; }
+    inline const ANNO* anno() const { load(LazyChunk_ANNO); return m_anno ? &*m_anno : nullptr; }
+    inline const Copy* copy() const { load(LazyChunk_Copy); return m_copy ? &*m_copy : nullptr; }
     inline const CAMG* camg() const { return m_camg ? &*m_camg : nullptr; }
-    inline const DYCP* dycp() const { return m_dycp ? &*m_dycp : nullptr; }
-    inline const BODY* body() const { return m_body.get(); }
-    inline const CMAP* cmap() const { return m_cmap.get(); }
-    inline const CTBL* ctbl() const { return m_ctbl.get(); }
-    inline const SHAM* sham() const { return m_sham.get(); }
-    inline const PCHG* pchg() const { return m_pchg.get(); }
-    inline const std::vector<CRNG>& crngs() const { return m_crngs; }
-    inline const std::vector<CCRT>& ccrts() const { return m_ccrts; }
+    inline const DYCP* dycp() const { load(LazyChunk_DYCP); return m_dycp ? &*m_dycp : nullptr; }
+    inline const BODY* body() const { load(LazyChunk_BODY); return m_body.get(); }
+    inline const CMAP* cmap() const { load(LazyChunk_CMAP); return m_cmap.get(); }
+    inline const CTBL* ctbl() const { load(LazyChunk_CTBL); return m_ctbl.get(); }
+    inline const SHAM* sham() const { load(LazyChunk_SHAM); return m_sham.get(); }
+    inline const PCHG* pchg() const { load(LazyChunk_PCHG); return m_pchg.get(); }
+    inline const std::vector<CRNG>& crngs() const { load(LazyChunk_CRNG); return m_crngs; }
+    inline const std::vector<CCRT>& ccrts() const { load(LazyChunk_CCRT); return m_ccrts; }
 
     inline BMHD& bmhd() { return m_bmhd; }
-    inline NAME* name() { return m_name ? &*m_name : nullptr; }
-    inline AUTH* auth() { return m_auth ? &*m_auth : nullptr; }
-    inline ANNO* anno() { return m_anno ? &*m_anno : nullptr; }
-    inline Copy* copy() { return m_copy ? &*m_copy : nullptr; }
+    inline NAME* name() { load(LazyChunk_NAME); return m_name ? &*m_name : nullptr; }
+    inline AUTH* auth() { load(LazyChunk_AUTH); return m_auth ? &*m_auth : nullptr; }
+    inline ANNO* anno() { load(LazyChunk_ANNO); return m_anno ? &*m_anno : nullptr; }
+    inline Copy* copy() { load(LazyChunk_Copy); return m_copy ? &*m_copy : nullptr; }
     inline CAMG* camg() { return m_camg ? &*m_camg : nullptr; }
-    inline DYCP* dycp() { return m_dycp ? &*m_dycp : nullptr; }
-    inline BODY* body() { return m_body.get(); }
-    inline CMAP* cmap() { return m_cmap.get(); }
-    inline CTBL* ctbl() { return m_ctbl.get(); }
-    inline SHAM* sham() { return m_sham.get(); }
-    inline PCHG* pchg() { return m_pchg.get(); }
-    inline std::vector<CRNG>& crngs() { return m_crngs; }
-    inline std::vector<CCRT>& ccrts() { return m_ccrts; }
+    inline DYCP* dycp() { load(LazyChunk_DYCP); return m_dycp ? &*m_dycp : nullptr; }
+    inline BODY* body() { load(LazyChunk_BODY); return m_body.get(); }
+    inline CMAP* cmap() { load(LazyChunk_CMAP); return m_cmap.get(); }
+    inline CTBL* ctbl() { load(LazyChunk_CTBL); return m_ctbl.get(); }
+    inline SHAM* sham() { load(LazyChunk_SHAM); return m_sham.get(); }
+    inline PCHG* pchg() { load(LazyChunk_PCHG); return m_pchg.get(); }
+    inline std::vector<CRNG>& crngs() { load(LazyChunk_CRNG); return m_crngs; }
+    inline std::vector<CCRT>& ccrts() { load(LazyChunk_CCRT); return m_ccrts; }
+
+    // The chunk directory built by scan(). Empty after read().
+    inline const std::vector<ChunkInfo>& chunks() const { return m_chunks; }
 
     inline void set_bmhd(BMHD bmhd) {
         m_bmhd = bmhd;
     }
 
-    inline NAME& make_name() { return m_name.emplace(); }
-    inline AUTH& make_auth() { return m_auth.emplace(); }
-    inline ANNO& make_anno() { return m_anno.emplace(); }
-    inline Copy& make_copy() { return m_copy.emplace(); }
+    inline NAME& make_name() { m_pending &= ~LazyChunk_NAME; return m_name.emplace(); }
+    inline AUTH& make_auth() { m_pending &= ~LazyChunk_AUTH; return m_auth.emplace(); }
+    inline ANNO& make_anno() { m_pending &= ~LazyChunk_ANNO; return m_anno.emplace(); }
+    inline Copy& make_copy() { m_pending &= ~LazyChunk_Copy; return m_copy.emplace(); }
 
-    inline void clear_name() { m_name = std::nullopt; }
-    inline void clear_auth() { m_auth = std::nullopt; }
-    inline void clear_anno() { m_anno = std::nullopt; }
-    inline void clear_copy() { m_copy = std::nullopt; }
+    inline void clear_name() { m_pending &= ~LazyChunk_NAME; m_name = std::nullopt; }
+    inline void clear_auth() { m_pending &= ~LazyChunk_AUTH; m_auth = std::nullopt; }
+    inline void clear_anno() { m_pending &= ~LazyChunk_ANNO; m_anno = std::nullopt; }
+    inline void clear_copy() { m_pending &= ~LazyChunk_Copy; m_copy = std::nullopt; }
 
     inline BODY& make_body() {
+        m_pending &= ~LazyChunk_BODY;
         m_body = std::make_unique<BODY>();
         return *m_body;
     }
 
-    inline void clear_body() { m_body = nullptr; }
+    inline void clear_body() { m_pending &= ~LazyChunk_BODY; m_body = nullptr; }
 
     Result read(MemoryReader& reader, bool only_metadata);
     Result read(MemoryReader& reader) { return read(reader, false); }
 
+    // Only the BODY chunk is decoded directly from the stream, all other
+    // chunks are small enough to be loaded one at a time.
+    Result read(StreamReader& reader, bool only_metadata);
+    Result read(StreamReader& reader) { return read(reader, false); }
+
+    // Only parses BMHD and CAMG and notes where all other chunks are. Those
+    // are parsed when they are first accessed, so the data has to outlive
+    // this object or the next call to load_all(). A chunk that fails to
+    // parse then is treated as missing.
+    Result scan(MemoryReader& reader);
+
+    // Parses all chunks that weren't accessed since scan() and releases the
+    // data. Returns the first error of any chunk parsed lazily.
+    Result load_all();
+
+    // Like load_all(), but leaves BODY pending, so it can be passed to
+    // decode_body() instead. The data still has to be around for that.
+    Result load_all_but_body();
+
+    // True if scan() found a BODY chunk that wasn't parsed yet.
+    bool has_pending_body() const;
+
+    // Decodes the pending BODY chunk with BODY::decode(). It stays pending.
+    Result decode_body(const BODY::Rows& rows) const;
+
     static bool can_read(MemoryReader& reader);
 
     void get_cycles(std::vector<Cycle>& cycles) const;
@@ -496,12 +649,64 @@ private:
     ILBM m_image;
     std::unique_ptr<Palette> m_palette;
     Palette m_cycled_palette;
+    PackedPalette m_packed_palette;
     std::vector<Cycle> m_cycles;
     bool m_ham;
 
+    // Pixels of each palette index that is part of a cycle, as (y << 16) | x.
+    // Those of index i are m_cycle_pixels[m_cycle_offsets[i]] up to
+    // m_cycle_offsets[i + 1]. Empty until render_frame() needs them.
+    std::vector<uint32_t> m_cycle_offsets;
+    std::vector<uint32_t> m_cycle_pixels;
+
+    // State of the last render_frame() and the one update_frame() prepared.
+    Palette m_frame_palette;
+    std::vector<uint8_t> m_changed_indices;
+    double m_frame_now;
+    bool m_frame_blend;
+    bool m_frame_valid;
+    bool m_cycles_visible;
+
+    // Distinct cycled palettes of a looping animation and which one each of
+    // its frames uses.
+    std::vector<Palette> m_cached_palettes;
+    std::vector<uint32_t> m_frame_palette_indices;
+    uint32_t m_cache_fps;
+    bool m_cache_blend;
+    size_t m_frame_cache_index;
+    size_t m_next_cache_index;
+
+    // PCHG compiled into palette changes per row: those of row y are
+    // m_pchg_regs[i] and m_pchg_colors[i] for i in [m_pchg_rows[y],
+    // m_pchg_rows[y + 1]), with colors packed like m_packed_palette. Changes
+    // of lines above the image count as row 0. Empty without PCHG.
+    std::vector<uint32_t> m_pchg_rows;
+    std::vector<uint8_t> m_pchg_regs;
+    std::vector<uint32_t> m_pchg_colors;
+
+    PixelFormat m_pixel_format;
+
+    void reset();
+    void init();
+    void init_body();
+    void init_cycle_pixels();
+    void init_pchg();
+
+    // Computes the palettes for render_rows().
+    void prepare_render(double now, bool blend);
+
+    // Renders rows [begin, end) of BODY pixels and alpha starting with row
+    // `begin`.
+    void render_rows(size_t begin, size_t end, const uint8_t* data, const uint8_t* alpha, uint8_t* pixels, size_t pitch);
+
 public:
     Renderer() :
-        m_image(), m_palette(), m_cycled_palette(), m_cycles(), m_ham(false) {}
+        m_image(), m_palette(), m_cycled_palette(), m_packed_palette(), m_cycles(), m_ham(false),
+        m_cycle_offsets(), m_cycle_pixels(), m_frame_palette(), m_changed_indices(),
+        m_frame_now(0.0), m_frame_blend(false), m_frame_valid(false), m_cycles_visible(false),
+        m_cached_palettes(), m_frame_palette_indices(), m_cache_fps(0), m_cache_blend(false),
+        m_frame_cache_index(SIZE_MAX), m_next_cache_index(SIZE_MAX),
+        m_pchg_rows(), m_pchg_regs(), m_pchg_colors(), m_pixel_format(PixelFormat_RGB888) {}
 
     inline const ILBM& image() const { return m_image; }
     inline const Palette* palette() const { return m_palette.get(); }
@@ -510,7 +715,58 @@ public:
     inline bool is_animated() const { return m_palette && m_cycles.size() > 0; }
 
     Result read(MemoryReader& reader);
+    Result read(StreamReader& reader);
     void render(uint8_t* pixels, size_t pitch, double now, bool blend);
+
+    // RGBA8888 for images with alpha, otherwise RGB888. read() and scan()
+    // reset the pixel format to this.
+    static PixelFormat default_pixel_format(const BMHD& bmhd);
+
+    // RGB32 and ARGB32_Premultiplied work for all images. Indexed8 only for
+    // images with one palette and no mask. Their color cycles only change
+    // color_table(), render_frame() leaves the pixels alone.
+    static bool supports_pixel_format(const ILBM& image, PixelFormat format);
+
+    inline PixelFormat pixel_format() const { return m_pixel_format; }
+
+    // Returns false and keeps the current format if it isn't supported.
+    bool set_pixel_format(PixelFormat format);
+
+    // The palette of the last render as 0xAARRGGBB, the color table of
+    // PixelFormat_Indexed8.
+    inline const uint32_t* color_table() const { return m_packed_palette.data(); }
+
+    // Static images can be decoded straight into the output, without keeping
+    // the decoded BODY: scan() reads everything but the BODY chunk, which is
+    // left in the data of `reader`. If can_render_body() then render_body()
+    // decodes and renders it, otherwise load() reads it. Either way the data
+    // has to stay around until then. After render_body() image().body() is
+    // null and render() can't be used.
+    Result scan(MemoryReader& reader);
+    inline bool can_render_body() const { return m_image.has_pending_body() && !is_animated(); }
+    Result render_body(uint8_t* pixels, size_t pitch);
+    Result load();
+
+    // Animations can be rendered in two steps: update_frame() computes the
+    // cycled palette for `now` and returns false if the frame looks exactly
+    // like the last one passed to render_frame(), so it can just be kept.
+    // Otherwise render_frame() writes it, where `pixels` has to still hold the
+    // last frame. Only pixels of changed_indices() are written then. The first
+    // frame after read() or invalidate_frame() is rendered completely.
+    bool update_frame(double now, bool blend);
+    void render_frame(uint8_t* pixels, size_t pitch);
+    inline const std::vector<uint8_t>& changed_indices() const { return m_changed_indices; }
+
+    // Computes the cycled palette of each of the first `frame_count` frames at
+    // `fps`, see cycles_loop_length(). Gives up and returns false if there are
+    // more than `max_palettes` distinct ones.
+    bool cache_palettes(uint32_t fps, size_t frame_count, bool blend, size_t max_palettes);
+    inline bool has_palette_cache() const { return !m_frame_palette_indices.empty(); }
+    inline size_t cached_frame_count() const { return m_frame_palette_indices.size(); }
+
+    // update_frame() for a frame of the palette cache (modulo its length).
+    bool update_cached_frame(size_t frame);
+    inline void invalidate_frame() { m_frame_valid = false; }
 };
 
 }
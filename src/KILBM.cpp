@@ -2,6 +2,8 @@
 
 #include <QtCore/QFile>
 
+#include "DeviceData.h"
+
 using namespace qilbm;
 
 ILBMExtractor::ILBMExtractor(QObject *parent) : ExtractorPlugin(parent) {}
@@ -22,12 +24,11 @@ void ILBMExtractor::extract(KFileMetaData::ExtractionResult* result)
         return;
     }
 
-    auto data = file.readAll();
     ILBM ilbm;
 
-    MemoryReader reader { (const uint8_t*)data.data(), (size_t)data.size() };
-
-    // TODO: don't read body, don't fail on things that can't be read
+    // Only the chunk directory is walked: BODY is skipped by seeking over it
+    // and of CTBL, SHAM and PCHG only the headers are read.
+    QIODeviceReader reader { &file };
     auto res = ilbm.read(reader, true);
 
     if (res != Result_Ok) {
@@ -94,12 +95,12 @@ void ILBMExtractor::extract(KFileMetaData::ExtractionResult* result)
         }
 
         if (ctbl) {
-            result->append(QStringLiteral("CTBL Palettes: %1\n").arg(ctbl->palettes().size()));
+            result->append(QStringLiteral("CTBL Palettes: %1\n").arg(ctbl->palette_count()));
         }
 
         if (sham) {
             result->append(QStringLiteral("SHAM Version: %1\n").arg((uint)sham->version()));
-            result->append(QStringLiteral("SHAM Palettes: %1\n").arg(sham->palettes().size()));
+            result->append(QStringLiteral("SHAM Palettes: %1\n").arg(sham->palette_count()));
         }
 
         if (pchg) {
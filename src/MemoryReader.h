@@ -57,6 +57,17 @@ public:
         }
     }
 
+    // Returns false if fewer than len bytes are left, the reader is at the
+    // end then.
+    inline bool skip(size_t len) {
+        if (len > m_size - m_offset) {
+            m_offset = m_size;
+            return false;
+        }
+        m_offset += len;
+        return true;
+    }
+
     inline MemoryReader slice(size_t length) const {
         size_t end_offset = m_offset + length;
         if (end_offset > m_size) {
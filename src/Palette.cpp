@@ -1,8 +1,52 @@
 #include "Palette.h"
 #include <cmath>
+#include <numeric>
 
 using namespace qilbm;
 
+uint64_t qilbm::cycles_loop_length(const std::vector<Cycle>& cycles, uint32_t fps, uint64_t max_frames) {
+    uint64_t length = 1;
+
+    for (const auto& cycle : cycles) {
+        if (cycle.high() <= cycle.low() || cycle.rate() == 0) {
+            continue;
+        }
+
+        // After n frames a cycle moved by rate * n / (DIVISOR * fps) entries,
+        // so it is back at the start when that is a multiple of its size.
+        const uint64_t size = (uint64_t)cycle.high() - (uint64_t)cycle.low() + 1;
+        const uint64_t steps = size * LBM_CYCLE_RATE_DIVISOR * fps;
+        const uint64_t period = steps / std::gcd(steps, (uint64_t)cycle.rate());
+
+        const uint64_t factor = period / std::gcd(length, period);
+        if (factor > max_frames / length) {
+            return 0;
+        }
+        length *= factor;
+    }
+
+    return length;
+}
+
+double qilbm::cycles_next_change(const std::vector<Cycle>& cycles, double now) {
+    double next = INFINITY;
+
+    for (const auto& cycle : cycles) {
+        if (cycle.high() <= cycle.low() || cycle.rate() == 0) {
+            continue;
+        }
+
+        // the distance changes whenever frate * now crosses an integer
+        const double frate = (double)cycle.rate() / (double)LBM_CYCLE_RATE_DIVISOR;
+        const double time = (std::floor(frate * now) + 1.0) / frate;
+        if (time < next) {
+            next = time;
+        }
+    }
+
+    return next;
+}
+
 void Palette::apply_cycle(const Cycle& cycle, double now) {
     uint8_t low = cycle.low();
     uint8_t high = cycle.high();
@@ -34,19 +78,23 @@ void Palette::apply_cycle_blended(const Palette& palette, const Cycle& cycle, do
         const Color* src = palette.m_data.data() + low;
         Color* dest = m_data.data() + low;
 
+        // fixed point and wrapping indices instead of modulo per entry
+        const uint32_t weight = (uint32_t)std::lround(mid * 65536.0);
+
         if (cycle.reverse()) {
+            uint32_t src_index1 = distance;
             for (uint32_t dest_index = 0; dest_index < size; ++ dest_index) {
-                uint32_t src_index = dest_index + distance;
-                uint32_t src_index1 = src_index % size;
-                uint32_t src_index2 = (src_index + 1) % size;
-                dest[dest_index] = src[src_index1].blend(src[src_index2], mid);
+                uint32_t src_index2 = src_index1 + 1 == size ? 0 : src_index1 + 1;
+                dest[dest_index] = src[src_index1].blend_fixed(src[src_index2], weight);
+                src_index1 = src_index2;
             }
         } else {
-            double inv = 1.0 - mid;
+            const uint32_t inv = 65536 - weight;
+            uint32_t dest_index = distance;
             for (uint32_t src_index1 = 0; src_index1 < size; ++ src_index1) {
-                uint32_t dest_index = (src_index1 + distance) % size;
-                uint32_t src_index2 = (src_index1 + 1) % size;
-                dest[dest_index] = src[src_index1].blend(src[src_index2], inv);
+                uint32_t src_index2 = src_index1 + 1 == size ? 0 : src_index1 + 1;
+                dest[dest_index] = src[src_index1].blend_fixed(src[src_index2], inv);
+                dest_index = dest_index + 1 == size ? 0 : dest_index + 1;
             }
         }
     }
@@ -69,3 +117,24 @@ void Palette::apply_cycles_from(const Palette& palette, const std::vector<Cycle>
         apply_cycles(cycles, now);
     }
 }
+
+void Palette::diff(const Palette& other, std::vector<uint8_t>& indices) const {
+    // most frames of slow cycles don't change anything
+    if (*this == other) {
+        return;
+    }
+
+    for (size_t index = 0; index < m_data.size(); ++ index) {
+        const Color& color = m_data[index];
+        const Color& other_color = other.m_data[index];
+        if (color.r() != other_color.r() || color.g() != other_color.g() || color.b() != other_color.b()) {
+            indices.push_back(index);
+        }
+    }
+}
+
+void PackedPalette::assign(const Palette& palette) {
+    for (size_t index = 0; index < m_data.size(); ++ index) {
+        set(index, palette[index]);
+    }
+}
@@ -5,6 +5,8 @@
 #include <array>
 #include <vector>
 #include <algorithm>
+#include <cstring>
+#include <stdint.h>
 
 #include "Color.h"
 
@@ -29,6 +31,14 @@ public:
     inline bool reverse() const { return m_reverse; }
 };
 
+// Number of frames at `fps` after which all cycles are back at their start,
+// blended or not. 0 if that's more than `max_frames`.
+uint64_t cycles_loop_length(const std::vector<Cycle>& cycles, uint32_t fps, uint64_t max_frames);
+
+// Time in seconds after `now` when the first of the cycles moves on by a whole
+// entry, i.e. when the unblended palette changes next. Infinity if never.
+double cycles_next_change(const std::vector<Cycle>& cycles, double now);
+
 class Palette {
 private:
     std::array<Color, 256> m_data;
@@ -68,13 +78,74 @@ public:
         m_data.fill(Color(0, 0, 0));
     }
 
+    inline bool operator==(const Palette& other) const {
+        return std::memcmp(m_data.data(), other.m_data.data(), sizeof(m_data)) == 0;
+    }
+
     void apply_cycle(const Cycle& cycle, double now);
     void apply_cycle_blended(const Palette& palette, const Cycle& cycle, double now);
     void apply_cycles(const std::vector<Cycle>& cycles, double now);
     void apply_cycles_from(const Palette& palette, const std::vector<Cycle>& cycles, double now, bool blend);
+
+    // Appends the indices whose color differs in `other`.
+    void diff(const Palette& other, std::vector<uint8_t>& indices) const;
+};
+
+// Pixel layouts that can be rendered.
+enum PixelFormat {
+    PixelFormat_RGB888               = 0, // bytes R, G, B
+    PixelFormat_RGBA8888             = 1, // bytes R, G, B, A
+    PixelFormat_RGB32                = 2, // native 32 bit words 0xFFRRGGBB
+    PixelFormat_ARGB32_Premultiplied = 3, // native 32 bit words 0xAARRGGBB, RGB multiplied by alpha
+    PixelFormat_Indexed8             = 4, // palette index per byte
 };
 
+// A palette as 32 bit pixels in the byte order of RGBA8888 images or, if
+// `argb` is set, as native 0xAARRGGBB words (RGB32, ARGB32_Premultiplied, Qt
+// color tables), so a pixel is written with a single store. Alpha is always 255.
+class PackedPalette {
+private:
+    std::array<uint32_t, 256> m_data;
+    bool m_argb;
+
+public:
+    PackedPalette() : m_data(), m_argb(false) {}
+
+    inline bool argb() const {
+        return m_argb;
+    }
+
+    // Doesn't convert the current pixels.
+    inline void set_argb(bool argb) {
+        m_argb = argb;
+    }
+
+    inline const uint32_t* data() const {
+        return m_data.data();
+    }
+
+    inline uint32_t operator[](uint8_t index) const {
+        return m_data[index];
+    }
+
+    static inline uint32_t pack(const Color& color, bool argb) {
+        if (argb) {
+            return 0xFF000000 | ((uint32_t)color.r() << 16) | ((uint32_t)color.g() << 8) | (uint32_t)color.b();
+        }
+        const uint8_t bytes[4] = { color.r(), color.g(), color.b(), 255 };
+        uint32_t value;
+        std::memcpy(&value, bytes, sizeof(bytes));
+        return value;
+    }
+
+    inline void set(uint8_t index, const Color& color) {
+        m_data[index] = pack(color, m_argb);
+    }
+
+    void assign(const Palette& palette);
+};
 
+// The 16 colors of a row in CTBL and SHAM, at the 12 bit depth of the file.
 class Palette16 {
 private:
     std::array<Color16, 16> m_data;
@@ -1,6 +1,11 @@
 #include "QILBM.h"
 
 #include <climits>
+#include <cmath>
+
+#include "C2P.h"
+#include "DeviceData.h"
+#include "ThreadPool.h"
 
 QDebug& operator<<(QDebug& debug, const qilbm::CRNG& crng) {
     bool spaces = debug.autoInsertSpaces();
@@ -63,6 +68,40 @@ void ILBMPlugin::readEnvVars() {
     } else {
         m_blend = blend;
     }
+
+    auto env_loop = QString::fromLocal8Bit(qgetenv("QILBM_LOOP")).trimmed();
+    m_loop = !env_loop.isEmpty() && (
+        env_loop.compare(QStringLiteral("true"), Qt::CaseInsensitive) == 0 ||
+        env_loop == QStringLiteral("1"));
+
+    auto env_indexed = QString::fromLocal8Bit(qgetenv("QILBM_INDEXED")).trimmed();
+    m_indexed = !env_indexed.isEmpty() && (
+        env_indexed.compare(QStringLiteral("true"), Qt::CaseInsensitive) == 0 ||
+        env_indexed == QStringLiteral("1"));
+
+    auto env_c2p = qgetenv("QILBM_C2P").trimmed().toLower();
+    if (!env_c2p.isEmpty()) {
+        C2PKernel kernel;
+        if (!c2p_kernel_from_name(env_c2p.constData(), kernel)) {
+            qWarning().nospace() << Q_FUNC_INFO << ": illegal value for QILBM_C2P environment variable: " << env_c2p;
+        } else if (!set_c2p_kernel(kernel)) {
+            qWarning().nospace() << Q_FUNC_INFO << ": planar to chunky kernel from QILBM_C2P environment variable is not supported by this CPU: " << env_c2p;
+        }
+    }
+
+    auto env_threads = QString::fromLocal8Bit(qgetenv("QILBM_THREADS")).trimmed();
+    if (!env_threads.isEmpty()) {
+        ok = true;
+        uint threads = env_threads.toUInt(&ok);
+        if (!ok) {
+            qWarning().nospace() << Q_FUNC_INFO << ": illegal value for QILBM_THREADS environment variable: " << env_threads;
+        } else if (threads > 256) {
+            qWarning().nospace() << Q_FUNC_INFO << ": value of QILBM_THREADS environment variable is too big, limited to 256 threads: " << env_threads;
+            set_thread_count(256);
+        } else {
+            set_thread_count(threads);
+        }
+    }
 }
 
 QImageIOPlugin::Capabilities ILBMPlugin::capabilities(QIODevice *device, const QByteArray &format) const {
@@ -86,8 +125,11 @@ QImageIOPlugin::Capabilities ILBMPlugin::capabilities(QIODevice *device, const Q
 }
 
 ILBMHandler* ILBMPlugin::create(QIODevice *device, const QByteArray &format) const {
-    auto handler = new ILBMHandler(m_blend, m_fps);
+    auto handler = new ILBMHandler(m_blend, m_fps, m_loop);
     handler->setDevice(device);
+    if (m_indexed) {
+        handler->setOption(QImageIOHandler::ImageFormat, QImage::Format::Format_Indexed8);
+    }
     if (format.isNull()) {
         handler->setFormat("ilbm");
     } else {
@@ -113,16 +155,99 @@ bool ILBMHandler::canRead(QIODevice *device) {
     return ILBM::can_read(reader);
 }
 
+static inline QImage::Format qImageFormat(PixelFormat format) {
+    switch (format) {
+        case PixelFormat_RGBA8888:             return QImage::Format::Format_RGBA8888;
+        case PixelFormat_RGB32:                return QImage::Format::Format_RGB32;
+        case PixelFormat_ARGB32_Premultiplied: return QImage::Format::Format_ARGB32_Premultiplied;
+        case PixelFormat_Indexed8:             return QImage::Format::Format_Indexed8;
+        default:                               return QImage::Format::Format_RGB888;
+    }
+}
+
+static inline bool pixelFormat(QImage::Format qformat, PixelFormat& format) {
+    switch (qformat) {
+        case QImage::Format::Format_RGB888:                format = PixelFormat_RGB888; return true;
+        case QImage::Format::Format_RGBA8888:              format = PixelFormat_RGBA8888; return true;
+        case QImage::Format::Format_RGB32:                 format = PixelFormat_RGB32; return true;
+        case QImage::Format::Format_ARGB32_Premultiplied:  format = PixelFormat_ARGB32_Premultiplied; return true;
+        case QImage::Format::Format_Indexed8:              format = PixelFormat_Indexed8; return true;
+        default:                                           return false;
+    }
+}
+
+PixelFormat ILBMHandler::pixelFormat(const ILBM& image) const {
+    PixelFormat format;
+    if (::pixelFormat(m_requestedFormat, format) && Renderer::supports_pixel_format(image, format)) {
+        return format;
+    }
+    return Renderer::default_pixel_format(image.bmhd());
+}
+
+// Indexed8 pixels are the palette indices, the colors go into the color table.
+static void setColorTable(QImage *image, const Renderer& renderer) {
+    if (image->format() == QImage::Format::Format_Indexed8) {
+        const uint32_t* colors = renderer.color_table();
+        const size_t count = (size_t)1 << renderer.image().bmhd().num_planes();
+        image->setColorTable(QList<QRgb>(colors, colors + count));
+    }
+}
+
 bool ILBMHandler::read() {
+    bool rendered = false;
+    return readFile(nullptr, rendered);
+}
+
+bool ILBMHandler::readFile(QImage *image, bool& rendered) {
     auto* device = this->device();
     if (device == nullptr) {
         qDebug().nospace() << Q_FUNC_INFO << ": device is null";
         return false;
     }
 
-    auto data = device->readAll();
-    MemoryReader reader { (const uint8_t*)data.data(), (size_t)data.size() };
-    Result result = m_renderer.read(reader);
+    // not needed anymore once the whole image is read
+    m_header = ILBM();
+    m_headerData.clear();
+    m_frame = QImage();
+    m_clock.invalidate();
+    m_clockOffset = 0.0;
+
+    Result result;
+    rendered = false;
+    m_devicePos = device->pos();
+    if (DeviceData::can_map(device)) {
+        DeviceData data { device };
+        MemoryReader reader { data.data(), data.size() };
+        if (image != nullptr) {
+            // Static images are decoded straight into the image, so the
+            // decoded BODY is never held in memory.
+            result = m_renderer.scan(reader);
+            if (result == Result_Ok && m_renderer.can_render_body()) {
+                const auto& header = m_renderer.image().bmhd();
+                const QSize size(header.width(), header.height());
+                m_renderer.set_pixel_format(pixelFormat(m_renderer.image()));
+                const auto format = qImageFormat(m_renderer.pixel_format());
+
+                if ((image->size() == size && image->format() == format) || allocateImage(size, format, image)) {
+                    result = m_renderer.render_body((uint8_t*)image->bits(), image->bytesPerLine());
+                    rendered = result == Result_Ok;
+                    if (rendered) {
+                        setColorTable(image, m_renderer);
+                    }
+                } else {
+                    // fails again in read(QImage*)
+                    result = m_renderer.load();
+                }
+            } else if (result == Result_Ok) {
+                result = m_renderer.load();
+            }
+        } else {
+            result = m_renderer.read(reader);
+        }
+    } else {
+        QIODeviceReader reader { device };
+        result = m_renderer.read(reader);
+    }
 
     switch (result) {
         case Result_Ok:
@@ -147,20 +272,63 @@ bool ILBMHandler::read() {
             return false;
     }
 
-    if (m_renderer.image().body() == nullptr) {
+    if (!rendered && m_renderer.image().body() == nullptr) {
         qDebug().nospace() << Q_FUNC_INFO << ": missing body";
         m_status = NoBody;
         return false;
     }
 
+    if (!rendered) {
+        m_renderer.set_pixel_format(pixelFormat(m_renderer.image()));
+    }
+
     m_currentFrame = 0;
+    m_loopLength = 0;
     m_imageCount = m_renderer.is_animated() ? 0 : 1;
 
+    if (m_loop && m_renderer.is_animated()) {
+        const auto length = cycles_loop_length(m_renderer.cycles(), m_fps, MAX_LOOP_FRAMES);
+        if (length == 0) {
+            qDebug().nospace() << Q_FUNC_INFO << ": color cycles loop after more than " << MAX_LOOP_FRAMES << " frames, playing endlessly";
+        } else {
+            m_loopLength = (int)length;
+            m_imageCount = m_loopLength;
+
+            if (length <= MAX_CACHED_FRAMES) {
+                m_renderer.cache_palettes(m_fps, length, m_blend, MAX_CACHED_PALETTES);
+            }
+        }
+    }
+
     return true;
 }
 
+const ILBM& ILBMHandler::header() const {
+    if (m_status != Init) {
+        return m_renderer.image();
+    }
+
+    if (!m_headerScanned) {
+        m_headerScanned = true;
+
+        auto* device = this->device();
+        if (device != nullptr) {
+            // Chunks are only parsed when an option asks for them. Those cut
+            // off by the peek size are missing or truncated, BODY usually is.
+            m_headerData = device->peek(HEADER_PEEK_SIZE);
+            MemoryReader reader { (const uint8_t*)m_headerData.constData(), (size_t)m_headerData.size() };
+            auto result = m_header.scan(reader);
+            if (result != Result_Ok) {
+                qDebug().nospace() << Q_FUNC_INFO << ": error scanning header: " << result_name(result);
+            }
+        }
+    }
+
+    return m_header;
+}
+
 QRect ILBMHandler::currentImageRect() const {
-    auto& header = m_renderer.image().bmhd();
+    auto& header = this->header().bmhd();
     return QRect(0, 0, header.width(), header.height());
 }
 
@@ -169,8 +337,19 @@ bool ILBMHandler::jumpToImage(int imageNumber) {
         return false;
     }
 
+    if (m_loopLength > 0) {
+        if (imageNumber >= m_loopLength) {
+            return false;
+        }
+        m_currentFrame = imageNumber;
+        return true;
+    }
+
     if (m_renderer.is_animated()) {
+        // the clock restarts there with the next frame
         m_currentFrame = imageNumber;
+        m_clockOffset = (double)imageNumber / (double)m_fps;
+        m_clock.invalidate();
         return true;
     }
 
@@ -178,6 +357,17 @@ bool ILBMHandler::jumpToImage(int imageNumber) {
         return false;
     }
 
+    if (m_status == Ok && m_renderer.image().body() == nullptr) {
+        // The BODY was decoded straight into the image and not kept, so it
+        // is read again from the device.
+        auto* device = this->device();
+        if (device == nullptr || device->isSequential() || !device->seek(m_devicePos)) {
+            return false;
+        }
+        m_status = Init;
+        m_headerScanned = false;
+    }
+
     m_currentFrame = 0;
     return true;
 }
@@ -185,42 +375,65 @@ bool ILBMHandler::jumpToImage(int imageNumber) {
 bool ILBMHandler::jumpToNextImage() {
     if (m_renderer.is_animated()) {
         m_currentFrame ++;
+        if (m_loopLength > 0 && m_currentFrame >= m_loopLength) {
+            m_currentFrame = 0;
+        }
         return true;
     }
 
     return false;
 }
 
-int ILBMHandler::nextImageDelay() const {
-    if (m_renderer.is_animated()) {
-        return 1000 / m_fps;
+double ILBMHandler::animationTime() const {
+    if (!m_clock.isValid()) {
+        return m_clockOffset;
     }
-    return 0;
+    return m_clockOffset + (double)m_clock.nsecsElapsed() / 1000000000.0;
 }
 
-static inline QImage::Format qImageFormat(const BMHD& header) {
-    const auto num_planes = header.num_planes();
-    return
-        num_planes == 32 || header.mask() == 1 ? QImage::Format::Format_RGBA8888 :
-        QImage::Format::Format_RGB888;
+int ILBMHandler::nextImageDelay() const {
+    if (!m_renderer.is_animated()) {
+        return 0;
+    }
+
+    // fps is the upper limit, blended cycles change all the time
+    const int min_delay = 1000 / m_fps;
+    if (m_blend || m_loopLength > 0) {
+        return min_delay;
+    }
+
+    // wait until the palette actually changes
+    const double now = animationTime();
+    const double delay = std::ceil((cycles_next_change(m_renderer.cycles(), now) - now) * 1000.0);
+    if (!(delay > (double)min_delay)) {
+        return min_delay;
+    }
+    return delay >= (double)INT_MAX ? INT_MAX : (int)delay;
 }
 
 QVariant ILBMHandler::option(ImageOption option) const {
     switch (option) {
         case ImageOption::Size:
         {
-            const auto& header = m_renderer.image().bmhd();
+            const auto& header = this->header().bmhd();
             return QSize(header.width(), header.height());
         }
         case ImageOption::Animation:
+            if (m_status == Init) {
+                const auto& image = header();
+                return image.cmap() != nullptr && !image.cycles().empty();
+            }
             return m_renderer.is_animated();
 
         case ImageOption::ImageFormat:
-            return qImageFormat(m_renderer.image().bmhd());
+            if (m_status == Init) {
+                return qImageFormat(pixelFormat(header()));
+            }
+            return qImageFormat(m_renderer.pixel_format());
 
         case ImageOption::Name:
         {
-            const auto* name = m_renderer.image().name();
+            const auto* name = header().name();
             if (name == nullptr) {
                 return QVariant();
             }
@@ -228,7 +441,7 @@ QVariant ILBMHandler::option(ImageOption option) const {
         }
         case ImageOption::Description:
         {
-            const auto& image = m_renderer.image();
+            const auto& image = header();
             const auto* auth = image.auth();
             const auto* copy = image.copy();
             const auto* anno = image.anno();
@@ -264,6 +477,18 @@ QVariant ILBMHandler::option(ImageOption option) const {
     }
 }
 
+void ILBMHandler::setOption(ImageOption option, const QVariant &value) {
+    switch (option) {
+        case ImageOption::ImageFormat:
+            // takes effect with the next read of the file
+            m_requestedFormat = (QImage::Format)value.toInt();
+            break;
+
+        default:
+            break;
+    }
+}
+
 bool ILBMHandler::supportsOption(ImageOption option) const {
     switch (option) {
         case ImageOption::Size:
@@ -292,7 +517,8 @@ bool ILBMHandler::read(QImage *image) {
     }
 
     bool init = m_status == Init;
-    if (init && !read()) {
+    bool rendered = false;
+    if (init && !readFile(image, rendered)) {
         qDebug().nospace() << Q_FUNC_INFO << ": read failed, status: " << statusMessage();
         return false;
     }
@@ -302,10 +528,62 @@ bool ILBMHandler::read(QImage *image) {
         return false;
     }
 
+    if (rendered) {
+        return true;
+    }
+
+    if (m_renderer.image().body() == nullptr) {
+        // it was decoded straight into the first image and isn't kept
+        qDebug().nospace() << Q_FUNC_INFO << ": image was already read";
+        return false;
+    }
+
     const auto& header = m_renderer.image().bmhd();
     const auto width = header.width();
     const auto height = header.height();
-    const auto format = qImageFormat(header);
+    const auto format = qImageFormat(m_renderer.pixel_format());
+
+    if (m_renderer.is_animated()) {
+        // Endless animations follow the clock, so slow rendering skips frames
+        // instead of slowing the animation down.
+        double now;
+        if (m_loopLength > 0) {
+            now = (double)m_currentFrame / (double)m_fps;
+        } else {
+            if (!m_clock.isValid()) {
+                m_clock.start();
+            }
+            now = animationTime();
+        }
+        //qInfo() << "FPS:" << m_fps << "delay:" << nextImageDelay() << "ms" << "now:" << now;
+
+        if (width != m_frame.width() || height != m_frame.height() || format != m_frame.format()) {
+            if (!allocateImage(QSize(width, height), format, &m_frame)) {
+                qDebug().nospace() << Q_FUNC_INFO << ": error allocating image";
+                return false;
+            }
+            m_renderer.invalidate_frame();
+        }
+
+        // Unchanged frames are handed out again without touching them. If the
+        // previous frame is still referenced bits() detaches, which copies it,
+        // so the frame stays valid for an update.
+        const bool changed = m_renderer.has_palette_cache() ?
+            m_renderer.update_cached_frame(m_currentFrame) :
+            m_renderer.update_frame(now, m_blend);
+
+        if (changed) {
+            m_renderer.render_frame((uint8_t*)m_frame.bits(), m_frame.bytesPerLine());
+            setColorTable(&m_frame, m_renderer);
+        }
+        *image = m_frame;
+
+        ++ m_currentFrame;
+        if (m_loopLength > 0 && m_currentFrame >= m_loopLength) {
+            m_currentFrame = 0;
+        }
+        return true;
+    }
 
     if (width != image->width() || height != image->height() || format != image->format()) {
         if (!allocateImage(QSize(width, height), format, image)) {
@@ -314,13 +592,8 @@ bool ILBMHandler::read(QImage *image) {
         }
     }
 
-    double now = (double)m_currentFrame / (double)m_fps;
-    //qInfo() << "FPS:" << m_fps << "delay:" << (1000 / m_fps) << "ms" << "now:" << now;
-    m_renderer.render((uint8_t*)image->bits(), image->bytesPerLine(), now, m_blend);
-
-    if (m_renderer.is_animated()) {
-        ++ m_currentFrame;
-    }
+    m_renderer.render((uint8_t*)image->bits(), image->bytesPerLine(), 0.0, m_blend);
+    setColorTable(image, m_renderer);
 
     return true;
 }
@@ -3,6 +3,8 @@
 #pragma once
 
 #include <QImageIOPlugin>
+#include <QImage>
+#include <QElapsedTimer>
 #include <memory>
 #include <vector>
 #include "ILBM.h"
@@ -30,15 +32,62 @@ public:
 private:
     Status m_status;
     bool m_blend;
+    bool m_loop;
     uint m_fps;
+    int m_loopLength;
     int m_imageCount;
     int m_currentFrame;
     Renderer m_renderer;
 
+    // Animations are rendered into this frame, only changed pixels are
+    // updated from one frame to the next.
+    QImage m_frame;
+
+    // Endless animations follow this clock, started with the first frame at
+    // m_clockOffset seconds. Loops count frames instead.
+    QElapsedTimer m_clock;
+    double m_clockOffset;
+
+    double animationTime() const;
+
+    // Chunk directory of the start of the file, so options can be answered
+    // before read() without decoding the image.
+    mutable QByteArray m_headerData;
+    mutable ILBM m_header;
+    mutable bool m_headerScanned;
+
+    const ILBM& header() const;
+
+    // Format asked for with setOption(ImageFormat), QImage::Format_Invalid
+    // if none. Used if the renderer supports it for the image.
+    QImage::Format m_requestedFormat;
+
+    PixelFormat pixelFormat(const ILBM& image) const;
+
+    // Device position the image was read from. A static image decoded
+    // straight into the QImage is read from there again when rewound.
+    qint64 m_devicePos;
+
+    // Reads the file. If `image` is given and the file can be mapped a static
+    // image is decoded straight into it, then `rendered` is set.
+    bool readFile(QImage *image, bool& rendered);
+
 public:
-    ILBMHandler(bool blend = false, uint fps = DEFAULT_FPS) :
-        QImageIOHandler(), m_status(Init), m_blend(blend), m_fps(fps),
-        m_imageCount(0), m_currentFrame(-1), m_renderer() {}
+    // How much of the device is peeked at for option() before read().
+    static const qint64 HEADER_PEEK_SIZE = 16 * 1024;
+
+    // Longer loops are played as endless animations.
+    static const int MAX_LOOP_FRAMES = 1 << 20;
+
+    // Limits of the palette cache of loops.
+    static const size_t MAX_CACHED_FRAMES = 1 << 16;
+    static const size_t MAX_CACHED_PALETTES = 4096;
+
+    ILBMHandler(bool blend = false, uint fps = DEFAULT_FPS, bool loop = false) :
+        QImageIOHandler(), m_status(Init), m_blend(blend), m_loop(loop), m_fps(fps),
+        m_loopLength(0), m_imageCount(0), m_currentFrame(-1), m_renderer(), m_frame(),
+        m_clock(), m_clockOffset(0.0), m_headerData(), m_header(), m_headerScanned(false),
+        m_requestedFormat(QImage::Format_Invalid), m_devicePos(0) {}
 
     ~ILBMHandler();
 
@@ -48,10 +97,11 @@ public:
     int imageCount() const override { return m_imageCount; }
     bool jumpToImage(int imageNumber) override;
     bool jumpToNextImage() override;
-    int loopCount() const override { return INT_MAX; }
+    int loopCount() const override { return m_loopLength > 0 ? -1 : INT_MAX; }
     int nextImageDelay() const override;
     QVariant option(ImageOption option) const override;
     bool read(QImage *image) override;
+    void setOption(ImageOption option, const QVariant &value) override;
     bool supportsOption(ImageOption option) const override;
 
     static bool canRead(QIODevice *device);
@@ -62,6 +112,11 @@ public:
     inline bool blend() const { return m_blend; }
     void setBlend(bool blend) { m_blend = blend; }
 
+    // Report color cycle animations as a loop of imageCount() frames. Has to
+    // be set, like fps and blend, before the image is read.
+    inline bool loop() const { return m_loop; }
+    void setLoop(bool loop) { m_loop = loop; }
+
     inline uint fps() const { return m_fps; }
     void setFps(uint fps) {
         if (fps > 0) {
@@ -81,6 +136,8 @@ class ILBMPlugin : public QImageIOPlugin {
 
 private:
     bool m_blend;
+    bool m_loop;
+    bool m_indexed;
     uint m_fps;
 
 protected:
@@ -88,12 +145,12 @@ protected:
 
 public:
     ILBMPlugin(QObject *parent = nullptr) :
-        QImageIOPlugin(parent), m_blend(false), m_fps(DEFAULT_FPS) {
+        QImageIOPlugin(parent), m_blend(false), m_loop(false), m_indexed(false), m_fps(DEFAULT_FPS) {
         readEnvVars();
     }
 
-    ILBMPlugin(QObject *parent, bool blend = false, uint fps = DEFAULT_FPS) :
-        QImageIOPlugin(parent), m_blend(blend), m_fps(fps == 0 ? 1 : fps) {}
+    ILBMPlugin(QObject *parent, bool blend = false, uint fps = DEFAULT_FPS, bool loop = false) :
+        QImageIOPlugin(parent), m_blend(blend), m_loop(loop), m_indexed(false), m_fps(fps == 0 ? 1 : fps) {}
 
     Capabilities capabilities(QIODevice *device, const QByteArray &format) const override;
     ILBMHandler* create(QIODevice *device, const QByteArray &format) const override;
@@ -101,6 +158,15 @@ public:
     inline bool blend() const { return m_blend; }
     void setBlend(bool blend) { m_blend = blend; }
 
+    inline bool loop() const { return m_loop; }
+    void setLoop(bool loop) { m_loop = loop; }
+
+    // Request QImage::Format_Indexed8 from created handlers, which is used
+    // for images that support it. Their color cycles then only change the
+    // color table.
+    inline bool indexed() const { return m_indexed; }
+    void setIndexed(bool indexed) { m_indexed = indexed; }
+
     inline uint fps() const { return m_fps; }
     void setFps(uint fps) {
         if (fps > 0) {
@@ -0,0 +1,215 @@
+#ifndef QILBM_STREAM_READER_H
+#define QILBM_STREAM_READER_H
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <array>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+namespace qilbm {
+
+// Source of bytes that is consumed front to back, e.g. a file descriptor or
+// a QIODevice. Unlike MemoryReader it doesn't need the whole file in memory.
+class StreamReader {
+public:
+    virtual ~StreamReader() {}
+
+    // Reads up to len bytes. Fewer are only returned at the end of the stream
+    // or on error.
+    virtual size_t read(uint8_t* buffer, size_t len) = 0;
+
+    // Returns false if the stream ended before len bytes could be skipped.
+    virtual bool skip(size_t len) {
+        uint8_t buffer[4096];
+        while (len > 0) {
+            const size_t count = len < sizeof(buffer) ? len : sizeof(buffer);
+            if (read(buffer, count) != count) {
+                return false;
+            }
+            len -= count;
+        }
+        return true;
+    }
+
+    inline bool read_exact(uint8_t* buffer, size_t len) {
+        return read(buffer, len) == len;
+    }
+
+    inline bool read_u32be(uint32_t& value) {
+        uint8_t buf[4];
+        if (!read_exact(buf, 4)) return false;
+        value = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+        return true;
+    }
+
+    inline bool read_fourcc(std::array<char, 4>& fourcc) {
+        return read_exact((uint8_t*)fourcc.data(), 4);
+    }
+};
+
+class FileDescriptorReader : public StreamReader {
+private:
+    int m_fd;
+
+public:
+    explicit FileDescriptorReader(int fd) : m_fd(fd) {}
+
+    inline int fd() const { return m_fd; }
+
+    size_t read(uint8_t* buffer, size_t len) override {
+        size_t offset = 0;
+        while (offset < len) {
+            const ssize_t count = ::read(m_fd, buffer + offset, len - offset);
+            if (count < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            if (count == 0) {
+                break;
+            }
+            offset += (size_t)count;
+        }
+        return offset;
+    }
+
+    bool skip(size_t len) override {
+        // lseek() doesn't fail past the end of the file, so only use it if
+        // the file is known to be long enough
+        const off_t pos = ::lseek(m_fd, 0, SEEK_CUR);
+        if (pos >= 0) {
+            const off_t end = ::lseek(m_fd, 0, SEEK_END);
+            if (end >= pos && (size_t)(end - pos) >= len) {
+                return ::lseek(m_fd, pos + (off_t)len, SEEK_SET) >= 0;
+            }
+            ::lseek(m_fd, pos, SEEK_SET);
+        }
+        return StreamReader::skip(len);
+    }
+};
+
+// Reads at most `limit` bytes of a StreamReader through a bounded buffer, so
+// that decoding can pull single bytes cheaply. Nothing past the limit is read
+// from the source, so the next chunk can be read from it afterwards.
+class BufferedReader {
+private:
+    StreamReader& m_source;
+    std::vector<uint8_t> m_buffer;
+    size_t m_offset;
+    size_t m_size;
+    size_t m_unread;
+
+    bool fill() {
+        if (m_offset > 0) {
+            std::memmove(m_buffer.data(), m_buffer.data() + m_offset, m_size - m_offset);
+            m_size -= m_offset;
+            m_offset = 0;
+        }
+
+        size_t count = m_buffer.size() - m_size;
+        if (count > m_unread) {
+            count = m_unread;
+        }
+        if (count == 0) {
+            return false;
+        }
+
+        const size_t actual = m_source.read(m_buffer.data() + m_size, count);
+        if (actual < count) {
+            // truncated stream, don't try again
+            m_unread = 0;
+        } else {
+            m_unread -= actual;
+        }
+        m_size += actual;
+        return actual > 0;
+    }
+
+public:
+    static const size_t DEFAULT_BUFFER_SIZE = 64 * 1024;
+
+    BufferedReader(StreamReader& source, size_t limit, size_t buffer_size = DEFAULT_BUFFER_SIZE) :
+        m_source(source), m_buffer(), m_offset(0), m_size(0), m_unread(limit) {
+        m_buffer.resize(buffer_size < limit ? buffer_size : limit);
+    }
+
+    // Bytes left until the limit, including ones the source might not have.
+    inline size_t remaining() const { return (m_size - m_offset) + m_unread; }
+
+    inline bool read_u8(uint8_t& value) {
+        if (m_offset >= m_size && !fill()) return false;
+        value = m_buffer[m_offset];
+        ++ m_offset;
+        return true;
+    }
+
+    bool read(uint8_t* chunk, size_t len) {
+        for (;;) {
+            const size_t available = m_size - m_offset;
+            const size_t count = len < available ? len : available;
+            std::memcpy(chunk, m_buffer.data() + m_offset, count);
+            m_offset += count;
+            chunk += count;
+            len -= count;
+
+            if (len == 0) {
+                return true;
+            }
+
+            if (len >= m_buffer.size() && len <= m_unread) {
+                // big reads bypass the buffer
+                const size_t actual = m_source.read(chunk, len);
+                m_unread = actual < len ? 0 : m_unread - len;
+                return actual == len;
+            }
+
+            if (!fill()) {
+                return false;
+            }
+        }
+    }
+
+    bool skip(size_t len) {
+        const size_t available = m_size - m_offset;
+        if (len <= available) {
+            m_offset += len;
+            return true;
+        }
+
+        len -= available;
+        m_offset = m_size;
+        if (len > m_unread) {
+            m_source.skip(m_unread);
+            m_unread = 0;
+            return false;
+        }
+
+        m_unread -= len;
+        return m_source.skip(len);
+    }
+
+    inline bool read_u32be(uint32_t& value) {
+        uint8_t buf[4];
+        if (!read(buf, 4)) return false;
+        value = ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+        return true;
+    }
+
+    inline bool read_fourcc(std::array<char, 4>& fourcc) {
+        return read((uint8_t*)fourcc.data(), 4);
+    }
+
+    // Consumes everything up to the limit.
+    inline bool skip_rest() {
+        return skip(remaining());
+    }
+};
+
+}
+
+#endif
@@ -0,0 +1,153 @@
+#include "ThreadPool.h"
+
+#include <memory>
+
+using namespace qilbm;
+
+ThreadPool::ThreadPool(size_t thread_count) :
+    m_workers(),
+    m_job_mutex(),
+    m_mutex(),
+    m_wake(),
+    m_done(),
+    m_generation(0),
+    m_stop(false),
+    m_active(0),
+    m_func(nullptr),
+    m_count(0),
+    m_chunk_size(1),
+    m_next(0) {
+    if (thread_count > 1) {
+        m_workers.reserve(thread_count - 1);
+        for (size_t index = 1; index < thread_count; ++ index) {
+            m_workers.emplace_back(&ThreadPool::work, this);
+        }
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lock(m_mutex);
+        m_stop = true;
+    }
+    m_wake.notify_all();
+
+    for (auto& worker : m_workers) {
+        worker.join();
+    }
+}
+
+void ThreadPool::run_chunks() {
+    for (;;) {
+        const size_t begin = m_next.fetch_add(m_chunk_size, std::memory_order_relaxed);
+        if (begin >= m_count) {
+            break;
+        }
+        const size_t end = m_count - begin < m_chunk_size ? m_count : begin + m_chunk_size;
+        (*m_func)(begin, end);
+    }
+}
+
+void ThreadPool::work() {
+    uint64_t generation = 0;
+    std::unique_lock lock(m_mutex);
+
+    for (;;) {
+        m_wake.wait(lock, [this, generation] { return m_stop || m_generation != generation; });
+        if (m_stop) {
+            return;
+        }
+        generation = m_generation;
+
+        lock.unlock();
+        run_chunks();
+        lock.lock();
+
+        // every worker checks in for every job, so none can miss one
+        if (-- m_active == 0) {
+            m_done.notify_one();
+        }
+    }
+}
+
+void ThreadPool::parallel_for(size_t count, const Func& func) {
+    if (count == 0) {
+        return;
+    }
+
+    std::unique_lock job_lock(m_job_mutex, std::try_to_lock);
+    if (!job_lock.owns_lock() || m_workers.empty() || count == 1) {
+        func(0, count);
+        return;
+    }
+
+    {
+        std::lock_guard lock(m_mutex);
+        // a few chunks per thread so uneven rows still balance out
+        const size_t chunk_count = thread_count() * 4;
+        m_func = &func;
+        m_count = count;
+        m_chunk_size = count < chunk_count ? 1 : count / chunk_count;
+        m_next.store(0, std::memory_order_relaxed);
+        m_active = m_workers.size();
+        ++ m_generation;
+    }
+    m_wake.notify_all();
+
+    run_chunks();
+
+    std::unique_lock lock(m_mutex);
+    m_done.wait(lock, [this] { return m_active == 0; });
+    m_func = nullptr;
+}
+
+static std::mutex global_pool_mutex;
+static std::shared_ptr<ThreadPool> global_pool;
+static size_t global_thread_count = 0;
+
+static size_t default_thread_count() {
+    const size_t count = std::thread::hardware_concurrency();
+    return count == 0 ? 1 : count;
+}
+
+static std::shared_ptr<ThreadPool> get_global_pool() {
+    std::lock_guard lock(global_pool_mutex);
+    if (!global_pool) {
+        global_pool = std::make_shared<ThreadPool>(global_thread_count == 0 ? default_thread_count() : global_thread_count);
+    }
+    return global_pool;
+}
+
+size_t qilbm::thread_count() {
+    std::lock_guard lock(global_pool_mutex);
+    if (global_pool) {
+        return global_pool->thread_count();
+    }
+    return global_thread_count == 0 ? default_thread_count() : global_thread_count;
+}
+
+void qilbm::set_thread_count(size_t count) {
+    std::shared_ptr<ThreadPool> old_pool;
+    {
+        std::lock_guard lock(global_pool_mutex);
+        if (count == global_thread_count) {
+            return;
+        }
+        global_thread_count = count;
+        // a running parallel_for() keeps its own reference to the old pool
+        old_pool = std::move(global_pool);
+    }
+}
+
+void qilbm::parallel_for(size_t count, const ThreadPool::Func& func) {
+    if (count == 0) {
+        return;
+    }
+
+    if (count == 1) {
+        func(0, count);
+        return;
+    }
+
+    get_global_pool()->parallel_for(count, func);
+}
@@ -0,0 +1,69 @@
+#ifndef QILBM_THREAD_POOL_H
+#define QILBM_THREAD_POOL_H
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+
+namespace qilbm {
+
+// Persistent worker threads for splitting loops over rows. The calling thread
+// takes part in the work, so a pool of N threads starts N - 1 workers.
+class ThreadPool {
+public:
+    using Func = std::function<void(size_t begin, size_t end)>;
+
+private:
+    std::vector<std::thread> m_workers;
+
+    // held for the whole duration of a parallel_for() call
+    std::mutex m_job_mutex;
+
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    uint64_t m_generation;
+    bool m_stop;
+    size_t m_active;
+
+    const Func* m_func;
+    size_t m_count;
+    size_t m_chunk_size;
+    std::atomic<size_t> m_next;
+
+    void work();
+    void run_chunks();
+
+public:
+    explicit ThreadPool(size_t thread_count);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    inline size_t thread_count() const { return m_workers.size() + 1; }
+
+    // Calls func for consecutive ranges that cover [0, count) and returns
+    // once all of them are done. If the pool is already busy (another thread
+    // or a nested call) everything runs in the calling thread instead.
+    void parallel_for(size_t count, const Func& func);
+};
+
+// Number of threads used for decoding and rendering, 1 means single threaded.
+size_t thread_count();
+
+// 0 means one thread per CPU core, which is also the default.
+void set_thread_count(size_t count);
+
+// parallel_for() on the shared pool.
+void parallel_for(size_t count, const ThreadPool::Func& func);
+
+}
+
+#endif